@@ -54,3 +54,36 @@ void computeProjectionAngleSet(std::vector<angle_t>& angles, int kernelSize) {
     angles[s + i].y = -ref.y;
   }
 }
+
+/// keep at most 'budget' angles of the set: the half circle is split into
+/// 'budget' cells of the same angular size, and each cell keeps its angle of
+/// lowest radius max(|x|,|y|) (the one giving the most samples of the power
+/// spectrum), the closest to the center of the cell in case of a tie
+void selectAngleBudget(std::vector<angle_t>& angles, int budget) {
+  if (budget <= 0 || (int)angles.size() <= budget) return;
+
+  std::vector<int> best(budget, -1);
+  std::vector<double> bestDistance(budget);
+  for (int i = 0; i < (int)angles.size(); i++) {
+    // angles are in [-pi/2, pi/2]
+    double position = (angles[i].angle + M_PI / 2) / M_PI * budget;
+    int cell = std::min(std::max((int)position, 0), budget - 1);
+    int radius = std::max(std::abs(angles[i].x), std::abs(angles[i].y));
+    double distance = std::abs(position - cell - 0.5);
+    int b = best[cell];
+    int bestRadius =
+        b < 0 ? 0 : std::max(std::abs(angles[b].x), std::abs(angles[b].y));
+    if (b < 0 || radius < bestRadius ||
+        (radius == bestRadius && distance < bestDistance[cell])) {
+      best[cell] = i;
+      bestDistance[cell] = distance;
+    }
+  }
+
+  // keep the order of the set (from pi/2 to -pi/2)
+  std::vector<angle_t> selected;
+  for (int cell = budget - 1; cell >= 0; cell--) {
+    if (best[cell] >= 0) selected.push_back(angles[best[cell]]);
+  }
+  angles = selected;
+}
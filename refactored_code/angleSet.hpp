@@ -10,3 +10,5 @@ struct angle_t {
 };
 
 void computeProjectionAngleSet(std::vector<angle_t>& angles, int kernelSize);
+
+void selectAngleBudget(std::vector<angle_t>& angles, int budget);
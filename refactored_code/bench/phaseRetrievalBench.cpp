@@ -0,0 +1,216 @@
+/// iterations-to-target benchmark of the phase retrieval update rules
+/// the Fourier magnitude of a set of synthetic kernels is given to tries of
+/// each update rule (see phaseRetrievalTry::iterate), and the number of
+/// iterations (and of Fourier transforms) that each try needs before the
+/// Fourier magnitude error of its estimate falls below a target is reported
+
+#include <algorithm>
+#include <cmath>
+#include <complex>
+#include <cstdio>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include "args.hxx"
+#include "image.hpp"
+#include "options.hpp"
+#include "phaseRetrieval.hpp"
+#include "rng.hpp"
+
+/// add a point of weight 1 at (x, y) to the kernel, split bilinearly
+static void splat(img_t<double>& kernel, double x, double y) {
+  int x0 = (int)std::floor(x);
+  int y0 = (int)std::floor(y);
+  double fx = x - x0;
+  double fy = y - y0;
+  for (int dy = 0; dy < 2; dy++) {
+    for (int dx = 0; dx < 2; dx++) {
+      int xx = x0 + dx;
+      int yy = y0 + dy;
+      if (xx < 0 || yy < 0 || xx >= kernel.w || yy >= kernel.h) continue;
+      kernel(xx, yy) += (dx ? fx : 1. - fx) * (dy ? fy : 1. - fy);
+    }
+  }
+}
+
+/// kernel drawn along the path (x(t), y(t)), t in [0, 1], around the center
+template <typename Path>
+static img_t<double> pathKernel(int kernelSize, Path path) {
+  img_t<double> kernel(kernelSize, kernelSize);
+  kernel.set_value(0.);
+  double c = kernelSize / 2;
+  const int samples = 64 * kernelSize;
+  for (int s = 0; s <= samples; s++) {
+    double x, y;
+    path(s / double(samples), x, y);
+    splat(kernel, c + x, c + y);
+  }
+  kernel.normalize();
+  return kernel;
+}
+
+/// synthetic kernels of size kernelSize: a gaussian, a disk (defocus), and
+/// straight, curved and broken motion paths
+static std::vector<std::pair<std::string, img_t<double>>> syntheticKernels(
+    int kernelSize) {
+  std::vector<std::pair<std::string, img_t<double>>> kernels;
+  double r = (kernelSize - 3) / 2.;
+  int c = kernelSize / 2;
+
+  img_t<double> gaussian(kernelSize, kernelSize);
+  double sigma = kernelSize / 8.;
+  for (int y = 0; y < kernelSize; y++)
+    for (int x = 0; x < kernelSize; x++)
+      gaussian(x, y) = std::exp(-((x - c) * (x - c) + (y - c) * (y - c)) /
+                                (2. * sigma * sigma));
+  gaussian.normalize();
+  kernels.emplace_back("gaussian", gaussian);
+
+  img_t<double> disk(kernelSize, kernelSize);
+  for (int y = 0; y < kernelSize; y++)
+    for (int x = 0; x < kernelSize; x++)
+      disk(x, y) = (x - c) * (x - c) + (y - c) * (y - c) <= r * r / 2.;
+  disk.normalize();
+  kernels.emplace_back("disk", disk);
+
+  kernels.emplace_back("line", pathKernel(kernelSize, [&](double t, double& x,
+                                                          double& y) {
+                         x = r * (2. * t - 1.) * 0.94;
+                         y = r * (2. * t - 1.) * 0.34;
+                       }));
+  kernels.emplace_back("arc", pathKernel(kernelSize, [&](double t, double& x,
+                                                         double& y) {
+                         double a = M_PI * (0.1 + 1.1 * t);
+                         x = r * std::cos(a);
+                         y = r * (std::sin(a) - 0.5);
+                       }));
+  kernels.emplace_back("shake", pathKernel(kernelSize, [&](double t, double& x,
+                                                           double& y) {
+                         x = r * (2. * t - 1.);
+                         y = r * 0.6 * std::sin(3. * M_PI * t) * (1. - t);
+                       }));
+  return kernels;
+}
+
+/// target Fourier magnitude of the phase retrieval for a kernel, with the
+/// layout of phaseRetrieval: a (4*kernelSize+1)^2 unshifted spectrum of the
+/// kernel placed in the top-left corner
+static img_t<double> kernelMagnitude(const img_t<double>& kernel) {
+  int size = 4 * kernel.w + 1;
+  img_t<std::complex<double>> ft(size, size);
+  ft.set_value(0);
+  for (int y = 0; y < kernel.h; y++)
+    for (int x = 0; x < kernel.w; x++) ft(x, y) = kernel(x, y);
+  ft.fft(ft);
+
+  img_t<double> magnitude(size, size);
+  for (int i = 0; i < ft.size; i++) magnitude[i] = std::abs(ft[i]);
+  return magnitude;
+}
+
+struct result {
+  int reached = 0;
+  std::vector<int> iterations;
+
+  double median() {
+    if (iterations.empty()) return NAN;
+    std::sort(iterations.begin(), iterations.end());
+    int n = iterations.size();
+    return (iterations[(n - 1) / 2] + iterations[n / 2]) / 2.;
+  }
+};
+
+/// number of iterations needed by one try to reach the target error, or -1
+static int iterationsToTarget(const img_t<double>& magnitude, int kernelSize,
+                              phaseRetrievalAlgorithm algorithm, uint64_t seed,
+                              int k, int maxIterations, double target) {
+  phaseRetrievalTry<double> pr;
+  pr.algorithm = algorithm;
+  pr.init(magnitude, rngStream(seed, k));
+  while (pr.m < maxIterations) {
+    pr.iterate(magnitude, kernelSize, pr.m + 1);
+    if (pr.error(magnitude, kernelSize) <= target) return pr.m;
+  }
+  return -1;
+}
+
+int main(int argc, char** argv) {
+  args::ArgumentParser parser(
+      "Iterations needed by each phase retrieval update rule to reach a "
+      "target Fourier magnitude error on synthetic kernels");
+  args::HelpFlag help(parser, "help", "Display this help menu", {'h', "help"});
+  args::ValueFlag<int> kernelSize{
+      parser, "size", "size of the synthetic kernels", {'k', "size"}, 15};
+  args::ValueFlag<int> Ntries{
+      parser, "Ntries", "number of tries per kernel", {'t', "Ntries"}, 30};
+  args::ValueFlag<int> maxIterations{parser,
+                                     "Ninner",
+                                     "maximum number of iterations of a try",
+                                     {'p', "Ninner"},
+                                     300};
+  args::ValueFlag<double> target{
+      parser,
+      "target",
+      "Fourier magnitude error (relative) that a try has to reach",
+      {"target"},
+      0.05};
+  args::ValueFlag<int> seed{parser, "seed", "seed of the tries", {"seed"}, 0};
+
+  try {
+    parser.ParseCLI(argc, argv);
+  } catch (const args::Help&) {
+    std::cout << parser;
+    return 0;
+  } catch (const args::Error& e) {
+    std::cerr << e.what() << std::endl;
+    std::cerr << parser;
+    return 1;
+  }
+  if (args::get(kernelSize) <= 0 || args::get(kernelSize) % 2 == 0) {
+    std::cerr << "Error: the kernel size has to be odd." << std::endl;
+    return 1;
+  }
+
+  const std::vector<std::pair<std::string, phaseRetrievalAlgorithm>>
+      algorithms = {{"raar", phaseRetrievalAlgorithm::RAAR},
+                    {"raar-adaptive", phaseRetrievalAlgorithm::adaptiveRAAR},
+                    {"hio", phaseRetrievalAlgorithm::HIO},
+                    {"dm", phaseRetrievalAlgorithm::differenceMap}};
+  auto kernels = syntheticKernels(args::get(kernelSize));
+
+  std::printf("# target error %g, %d tries of at most %d iterations\n",
+              args::get(target), args::get(Ntries), args::get(maxIterations));
+  std::printf("%-14s %-9s %8s %12s %12s\n", "algorithm", "kernel", "reached",
+              "median iter", "median FFTs");
+  for (const auto& [algorithmName, algorithm] : algorithms) {
+    result total;
+    for (const auto& [kernelName, kernel] : kernels) {
+      img_t<double> magnitude = kernelMagnitude(kernel);
+      result r;
+      std::vector<int> iterations(args::get(Ntries));
+#pragma omp parallel for schedule(dynamic)
+      for (int k = 0; k < args::get(Ntries); k++) {
+        iterations[k] = iterationsToTarget(
+            magnitude, kernel.w, algorithm, args::get(seed), k,
+            args::get(maxIterations), args::get(target));
+      }
+      for (int m : iterations) {
+        if (m < 0) continue;
+        r.reached++;
+        r.iterations.push_back(m);
+        total.reached++;
+        total.iterations.push_back(m);
+      }
+      double median = r.median();
+      std::printf("%-14s %-9s %4d/%-3d %12.1f %12.1f\n", algorithmName.c_str(),
+                  kernelName.c_str(), r.reached, args::get(Ntries), median,
+                  median * transformsPerIteration(algorithm));
+    }
+    double median = total.median();
+    std::printf("%-14s %-9s %4d/%-3d %12.1f %12.1f\n", algorithmName.c_str(),
+                "all", total.reached, args::get(Ntries) * (int)kernels.size(),
+                median, median * transformsPerIteration(algorithm));
+  }
+  return 0;
+}
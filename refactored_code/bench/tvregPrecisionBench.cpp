@@ -0,0 +1,160 @@
+/// float versus double benchmark of the TV deconvolution (deconvBregman)
+/// a synthetic piecewise constant image is blurred (periodically) by a
+/// motion kernel, then deconvolved in both precisions; the best time over
+/// several runs and the PSNR of each result against the sharp image and of
+/// the float result against the double one are reported
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <iostream>
+#include <limits>
+
+#include "args.hxx"
+#include "deconvBregman.hpp"
+#include "image.hpp"
+#include "rng.hpp"
+
+/// random rectangles of random grey levels in [0, 255] on a grey background
+static img_t<double> sharpImage(int size, uint64_t seed) {
+  img_t<double> img(size, size);
+  img.set_value(128.);
+  rngStream rng(seed, 0);
+  for (int r = 0; r < 200; r++) {
+    int x0 = rng.uniform() * size;
+    int y0 = rng.uniform() * size;
+    int w = 4 + rng.uniform() * size / 6;
+    int h = 4 + rng.uniform() * size / 6;
+    double value = 255. * rng.uniform();
+    for (int y = y0; y < std::min(y0 + h, size); y++)
+      for (int x = x0; x < std::min(x0 + w, size); x++) img(x, y) = value;
+  }
+  return img;
+}
+
+/// diagonal motion kernel of size 'size'
+static img_t<double> motionKernel(int size) {
+  img_t<double> kernel(size, size);
+  kernel.set_value(0.);
+  for (int i = 0; i < size; i++) kernel(i, size / 2 + (i - size / 2) / 3) = 1.;
+  kernel.normalize();
+  return kernel;
+}
+
+/// periodic convolution of the image with the kernel (centered), plus a
+/// uniform noise of amplitude 'noise'
+static img_t<double> blur(const img_t<double>& img, const img_t<double>& kernel,
+                          double noise, uint64_t seed) {
+  img_t<double> out(img.w, img.h);
+  rngStream rng(seed, 1);
+  for (int y = 0; y < img.h; y++) {
+    for (int x = 0; x < img.w; x++) {
+      double value = 0.;
+      for (int ky = 0; ky < kernel.h; ky++) {
+        for (int kx = 0; kx < kernel.w; kx++) {
+          int xx = (x - kx + kernel.w / 2 + img.w) % img.w;
+          int yy = (y - ky + kernel.h / 2 + img.h) % img.h;
+          value += kernel(kx, ky) * img(xx, yy);
+        }
+      }
+      out(x, y) = value + noise * (2. * rng.uniform() - 1.);
+    }
+  }
+  return out;
+}
+
+static double psnr(const img_t<double>& a, const img_t<double>& b) {
+  double mse = 0.;
+  for (int i = 0; i < a.size; i++) mse += (a[i] - b[i]) * (a[i] - b[i]);
+  mse /= a.size;
+  return 10. * std::log10(255. * 255. / mse);
+}
+
+/// deconvolve in precision S, returns the best time (in ms) over 'repeats'
+template <typename S>
+static double timeDeconvolution(img_t<double>& u, const img_t<double>& f,
+                                const img_t<double>& kernel, int iterations,
+                                double lambda, int repeats, int threads) {
+  typename tvreg<S>::context* context = tvreg<S>::newContext(f.w, f.h, 1);
+  double best = std::numeric_limits<double>::max();
+  for (int r = 0; r < repeats; r++) {
+    auto start = std::chrono::steady_clock::now();
+    deconvBregmanWithPrecision<S>(u, f, kernel, iterations, lambda, 400.,
+                                  context, threads);
+    std::chrono::duration<double, std::milli> elapsed =
+        std::chrono::steady_clock::now() - start;
+    best = std::min(best, elapsed.count());
+  }
+  tvreg<S>::freeContext(context);
+  return best;
+}
+
+int main(int argc, char** argv) {
+  args::ArgumentParser parser(
+      "Time and accuracy of the TV deconvolution in single and double "
+      "precision on a synthetic blurred image");
+  args::HelpFlag help(parser, "help", "Display this help menu", {'h', "help"});
+  args::ValueFlag<int> size{
+      parser, "size", "size of the (square) image", {'s', "size"}, 512};
+  args::ValueFlag<int> kernelSize{
+      parser, "size", "size of the motion kernel", {'k', "kernelSize"}, 15};
+  args::ValueFlag<int> iterations{parser,
+                                  "iterations",
+                                  "iterations of the TV deconvolution",
+                                  {'n', "iterations"},
+                                  20};
+  args::ValueFlag<double> lambda{
+      parser, "lambda", "regularization weight", {'l', "lambda"}, 3000.};
+  args::ValueFlag<double> noise{
+      parser, "noise", "amplitude of the uniform noise", {"noise"}, 1.};
+  args::ValueFlag<int> repeats{
+      parser, "repeats", "number of timed runs", {'r', "repeats"}, 5};
+  args::ValueFlag<int> threads{
+      parser, "threads", "threads of the TV solver", {'t', "threads"}, 1};
+
+  try {
+    parser.ParseCLI(argc, argv);
+  } catch (const args::Help&) {
+    std::cout << parser;
+    return 0;
+  } catch (const args::Error& e) {
+    std::cerr << e.what() << std::endl;
+    std::cerr << parser;
+    return 1;
+  }
+  if (args::get(size) <= args::get(kernelSize) ||
+      args::get(kernelSize) % 2 == 0) {
+    std::cerr << "Error: the kernel size has to be odd and smaller than the "
+                 "image."
+              << std::endl;
+    return 1;
+  }
+
+  img_t<double> sharp = sharpImage(args::get(size), 0);
+  img_t<double> kernel = motionKernel(args::get(kernelSize));
+  img_t<double> blurred = blur(sharp, kernel, args::get(noise), 0);
+
+  img_t<double> deconvDouble;
+  img_t<double> deconvFloat;
+  double timeDouble = timeDeconvolution<double>(
+      deconvDouble, blurred, kernel, args::get(iterations), args::get(lambda),
+      args::get(repeats), args::get(threads));
+  double timeFloat = timeDeconvolution<float>(
+      deconvFloat, blurred, kernel, args::get(iterations), args::get(lambda),
+      args::get(repeats), args::get(threads));
+
+  std::printf("# %dx%d image, %dx%d kernel, %d iterations, %d threads\n",
+              args::get(size), args::get(size), args::get(kernelSize),
+              args::get(kernelSize), args::get(iterations),
+              args::get(threads));
+  std::printf("%-8s %10s %14s\n", "solver", "time (ms)", "PSNR (dB)");
+  std::printf("%-8s %10.2f %14.3f\n", "blurred", 0., psnr(blurred, sharp));
+  std::printf("%-8s %10.2f %14.3f\n", "double", timeDouble,
+              psnr(deconvDouble, sharp));
+  std::printf("%-8s %10.2f %14.3f\n", "float", timeFloat,
+              psnr(deconvFloat, sharp));
+  std::printf("float against double: %.3f dB, speedup %.2f\n",
+              psnr(deconvFloat, deconvDouble), timeDouble / timeFloat);
+  return 0;
+}
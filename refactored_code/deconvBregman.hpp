@@ -1,6 +1,7 @@
 #pragma once
 
 #include <array>
+#include <type_traits>
 
 #include "image.hpp"
 
@@ -9,6 +10,63 @@ extern "C" {
 #include "tvdeconv_20120607/tvregopt.h"
 }
 
+// the single precision instance of tvreg (see tvreg_single.h): its types
+// differ from the double precision ones, hence the namespace
+namespace tvreg_single {
+#define NUM_SINGLE
+extern "C" {
+#include "tvdeconv_20120607/tvreg.h"
+#include "tvdeconv_20120607/tvregopt.h"
+}
+#undef NUM_SINGLE
+#include "tvdeconv_20120607/tvreg_single.h"
+}  // namespace tvreg_single
+
+/// the functions of the instance of tvreg computing in T (double or float)
+template <typename T>
+struct tvreg;
+
+template <>
+struct tvreg<double> {
+  using opt = tvregopt;
+  using context = tvregcontext;
+  static constexpr auto newOpt = TvRegNewOpt;
+  static constexpr auto freeOpt = TvRegFreeOpt;
+  static constexpr auto setKernel = TvRegSetKernel;
+  static constexpr auto setLambda = TvRegSetLambda;
+  static constexpr auto setMaxIter = TvRegSetMaxIter;
+  static constexpr auto setGamma1 = TvRegSetGamma1;
+  static constexpr auto setTol = TvRegSetTol;
+  static constexpr auto setContext = TvRegSetContext;
+  static constexpr auto setPeriodic = TvRegSetPeriodic;
+  static constexpr auto setNumThreads = TvRegSetNumThreads;
+  static constexpr auto setPlotFun = TvRegSetPlotFun;
+  static constexpr auto restore = TvRestore;
+  static constexpr auto newContext = TvRegNewContext;
+  static constexpr auto freeContext = TvRegFreeContext;
+};
+
+template <>
+struct tvreg<float> {
+  using opt = tvreg_single::tvregopt;
+  using context = tvreg_single::tvregcontext;
+  static constexpr auto newOpt = tvreg_single::SingleTvRegNewOpt;
+  static constexpr auto freeOpt = tvreg_single::SingleTvRegFreeOpt;
+  static constexpr auto setKernel = tvreg_single::SingleTvRegSetKernel;
+  static constexpr auto setLambda = tvreg_single::SingleTvRegSetLambda;
+  static constexpr auto setMaxIter = tvreg_single::SingleTvRegSetMaxIter;
+  static constexpr auto setGamma1 = tvreg_single::SingleTvRegSetGamma1;
+  static constexpr auto setTol = tvreg_single::SingleTvRegSetTol;
+  static constexpr auto setContext = tvreg_single::SingleTvRegSetContext;
+  static constexpr auto setPeriodic = tvreg_single::SingleTvRegSetPeriodic;
+  static constexpr auto setNumThreads =
+      tvreg_single::SingleTvRegSetNumThreads;
+  static constexpr auto setPlotFun = tvreg_single::SingleTvRegSetPlotFun;
+  static constexpr auto restore = tvreg_single::SingleTvRestore;
+  static constexpr auto newContext = tvreg_single::SingleTvRegNewContext;
+  static constexpr auto freeContext = tvreg_single::SingleTvRegFreeContext;
+};
+
 /// pad an image using constant boundaries
 template <typename T>
 static void padimage_replicate(img_t<T>& out, const img_t<T>& in, int padding) {
@@ -63,32 +121,39 @@ static void unpadimage(img_t<T>& out, const img_t<T>& in, int padding) {
   }
 }
 
-/// smooth the borders of an image so that the result is more periodic
-/// see matlab:'help edgetaper'
+/// compute the blending weights used by edgetaper for an image of size w*h
+/// and a kernel of size kw*kh (kind of tukey window)
 template <typename T>
-static void edgetaper(img_t<T>& out, const img_t<T>& in, const img_t<T>& kernel,
-                      int iterations = 1) {
-  out.ensure_size(in.w, in.h, in.d);
-
-  img_t<T> weights(in.w, in.h);
-  // kind of tukey window
-  for (int y = 0; y < in.h; y++) {
+static void edgetaperWeights(img_t<T>& weights, int w, int h, int kw,
+                             int kh) {
+  weights.ensure_size(w, h);
+  for (int y = 0; y < h; y++) {
     T wy = 1.;
-    if (y < kernel.h) {
-      wy = std::pow(std::sin(y * M_PI / (kernel.h * 2 - 1)), 2.);
-    } else if (y > in.h - kernel.h) {
-      wy = std::pow(std::sin((in.h - 1 - y) * M_PI / (kernel.h * 2 - 1)), 2.);
+    if (y < kh) {
+      wy = std::pow(std::sin(y * M_PI / (kh * 2 - 1)), 2.);
+    } else if (y > h - kh) {
+      wy = std::pow(std::sin((h - 1 - y) * M_PI / (kh * 2 - 1)), 2.);
     }
-    for (int x = 0; x < in.w; x++) {
+    for (int x = 0; x < w; x++) {
       T wx = 1.;
-      if (x < kernel.w) {
-        wx = std::pow(std::sin(x * M_PI / (kernel.w * 2 - 1)), 2.);
-      } else if (x > in.w - kernel.w) {
-        wx = std::pow(std::sin((in.w - 1 - x) * M_PI / (kernel.w * 2 - 1)), 2.);
+      if (x < kw) {
+        wx = std::pow(std::sin(x * M_PI / (kw * 2 - 1)), 2.);
+      } else if (x > w - kw) {
+        wx = std::pow(std::sin((w - 1 - x) * M_PI / (kw * 2 - 1)), 2.);
       }
       weights(x, y) = wx * wy;
     }
   }
+}
+
+/// same as edgetaper, but with precomputed weights (see edgetaperWeights)
+/// and Fourier transform of the input image
+template <typename T>
+static void edgetaper(img_t<T>& out, const img_t<T>& in,
+                      const img_t<std::complex<T>>& in_ft,
+                      const img_t<T>& weights, const img_t<T>& kernel,
+                      int iterations = 1) {
+  out.ensure_size(in.w, in.h, in.d);
 
   // kernel's fft
   img_t<T> blurred(in.w, in.h, in.d);
@@ -100,9 +165,12 @@ static void edgetaper(img_t<T>& out, const img_t<T>& in, const img_t<T>& kernel,
 
   out.copy(in);
   for (int i = 0; i < iterations; i++) {
-    blurred_ft.copy(out);
-
-    blurred_ft.fft(blurred_ft);
+    if (i == 0) {
+      blurred_ft.copy(in_ft);
+    } else {
+      blurred_ft.copy(out);
+      blurred_ft.fft(blurred_ft);
+    }
     for (int y = 0; y < out.h; y++)
       for (int x = 0; x < out.w; x++)
         for (int l = 0; l < out.d; l++) blurred_ft(x, y, l) *= kernel_ft(x, y);
@@ -123,16 +191,41 @@ static void edgetaper(img_t<T>& out, const img_t<T>& in, const img_t<T>& kernel,
   }
 }
 
+/// smooth the borders of an image so that the result is more periodic
+/// see matlab:'help edgetaper'
 template <typename T>
-void pad_and_taper(img_t<T>& u, const img_t<T>& f, const img_t<T>& K) {
-  int padding = std::max(K.w, K.h);
-  img_t<T> padded;
-  padimage_replicate(padded, f, padding);
+static void edgetaper(img_t<T>& out, const img_t<T>& in, const img_t<T>& kernel,
+                      int iterations = 1) {
+  img_t<T> weights;
+  edgetaperWeights(weights, in.w, in.h, kernel.w, kernel.h);
+
+  img_t<std::complex<T>> in_ft(in.w, in.h, in.d);
+  in_ft.copy(in);
+  in_ft.fft(in_ft);
 
-  img_t<T> tapered;
+  edgetaper(out, in, in_ft, weights, kernel, iterations);
+}
+
+/// pad an image for the deconvolution by a kernel of the given size
+/// (only depends on the size of the kernel, not on its values)
+template <typename T>
+void pad_for_kernel(img_t<T>& padded, const img_t<T>& f, int kernelSize) {
+  padimage_replicate(padded, f, kernelSize);
+}
+
+/// same as pad_and_taper, for an image already padded by pad_for_kernel
+template <typename T>
+void taper_padded(img_t<T>& u, const img_t<T>& padded, const img_t<T>& K) {
   edgetaper(u, padded, K, 4);
 }
 
+template <typename T>
+void pad_and_taper(img_t<T>& u, const img_t<T>& f, const img_t<T>& K) {
+  img_t<T> padded;
+  pad_for_kernel(padded, f, std::max(K.w, K.h));
+  taper_padded(u, padded, K);
+}
+
 template <typename T>
 void unpad(img_t<T>& u, const img_t<T>& f, const img_t<T>& K) {
   int padding = std::max(K.w, K.h);
@@ -175,10 +268,18 @@ static void ycbcr2rgb(img_t<T>& out, const img_t<T>& in) {
 
 /// deconvolve an image using Split bregman
 /// deconvolve only the luminance
-/// boundaries have to be handled elsewhere
+/// boundaries have to be handled elsewhere: f is assumed periodic (tapered,
+/// see pad_and_taper), so that the nonsymmetric kernels are deconvolved at the
+/// size of f instead of its symmetric extension (see TvRegSetPeriodic)
+/// 'context' optionally holds the buffers and plans of tvreg for the size of f
+/// (see TvRegNewContext), reused by the calls on images of that size
+/// 'threads' is the size of the team running the pointwise loops of tvreg
+/// the TV deconvolution computes in T (see tvreg)
 template <typename T>
 void deconvBregman(img_t<T>& u, const img_t<T>& f, const img_t<T>& K,
-                   int numIter = 30, T lambda = 2000., T beta = 400.) {
+                   int numIter = 30, T lambda = 2000., T beta = 400.,
+                   typename tvreg<T>::context* context = nullptr,
+                   int threads = 1) {
   if (f.d == 3) {
     // convert to YCbCr
     img_t<T> ycbcr;
@@ -188,7 +289,7 @@ void deconvBregman(img_t<T>& u, const img_t<T>& f, const img_t<T>& K,
 
     // deconvolve Y
     img_t<T> ydeconv;
-    deconvBregman(ydeconv, y, K, numIter, lambda, beta);
+    deconvBregman(ydeconv, y, K, numIter, lambda, beta, context, threads);
 
     // convert to RGB
     for (int i = 0; i < y.w * y.h; i++) ycbcr[i * 3] = ydeconv[i];
@@ -214,18 +315,21 @@ void deconvBregman(img_t<T>& u, const img_t<T>& f, const img_t<T>& K,
   }
 
   // deconvolve
-  tvregopt* tv = TvRegNewOpt();
-  TvRegSetKernel(tv, &K[0], K.w, K.h);
-  TvRegSetLambda(tv, lambda);
-  TvRegSetMaxIter(tv, numIter);
-  TvRegSetGamma1(tv, beta);
-  TvRegSetTol(tv, .000001);
-
-  TvRegSetPlotFun(tv, nullptr, nullptr);
-  TvRestore(&deconv_planar[0], &f_planar[0], f_planar.w, f_planar.h, f_planar.d,
-            tv);
-
-  TvRegFreeOpt(tv);
+  typename tvreg<T>::opt* tv = tvreg<T>::newOpt();
+  tvreg<T>::setKernel(tv, &K[0], K.w, K.h);
+  tvreg<T>::setLambda(tv, lambda);
+  tvreg<T>::setMaxIter(tv, numIter);
+  tvreg<T>::setGamma1(tv, beta);
+  tvreg<T>::setTol(tv, .000001);
+  tvreg<T>::setContext(tv, context);
+  tvreg<T>::setPeriodic(tv, 1);
+  tvreg<T>::setNumThreads(tv, threads);
+
+  tvreg<T>::setPlotFun(tv, nullptr, nullptr);
+  tvreg<T>::restore(&deconv_planar[0], &f_planar[0], f_planar.w, f_planar.h,
+                    f_planar.d, tv);
+
+  tvreg<T>::freeOpt(tv);
 
   // reorder to interleaved
   u.ensure_size(deconv_planar.w, deconv_planar.h, deconv_planar.d);
@@ -241,3 +345,26 @@ void deconvBregman(img_t<T>& u, const img_t<T>& f, const img_t<T>& K,
     u.copy(deconv_planar);
   }
 }
+
+/// deconvBregman of images of T, computed in S: with S = float, the TV
+/// deconvolution runs in single precision, with half the memory of the
+/// solver
+template <typename S, typename T>
+void deconvBregmanWithPrecision(img_t<T>& u, const img_t<T>& f,
+                                const img_t<T>& K, int numIter, T lambda,
+                                T beta,
+                                typename tvreg<S>::context* context = nullptr,
+                                int threads = 1) {
+  if constexpr (std::is_same_v<S, T>) {
+    deconvBregman(u, f, K, numIter, lambda, beta, context, threads);
+  } else {
+    img_t<S> fS(f.w, f.h, f.d);
+    fS.copy(f);
+    img_t<S> KS(K.w, K.h, K.d);
+    KS.copy(K);
+    img_t<S> uS;
+    deconvBregman(uS, fS, KS, numIter, S(lambda), S(beta), context, threads);
+    u.ensure_size(uS.w, uS.h, uS.d);
+    u.copy(uS);
+  }
+}
@@ -1,5 +1,8 @@
 #pragma once
 
+#include <algorithm>
+#include <deque>
+#include <string>
 #include <vector>
 
 #include "angleSet.hpp"
@@ -9,6 +12,7 @@
 #include "phaseRetrieval.hpp"
 #include "projectImage.hpp"
 #include "reconstructPowerspectrum.hpp"
+#include "stats.hpp"
 
 /// search a patch with high variance in the greyscale blurred image
 template <typename T>
@@ -59,27 +63,38 @@ static void searchBlurredPatch(img_t<T>& window, const img_t<T>& blurredImage,
 }
 
 /// apply a circular median filter on each column
+/// the window slides along the column: its values are kept sorted, and each
+/// step removes the value leaving the window and inserts the one entering it
+/// (instead of sorting the whole window for each pixel)
 template <typename T>
 static void circularMedianFilter(img_t<T>& img, int size) {
   img_t<T> copy(img);
-  std::vector<T> pixels(size);
-  for (int y = 0; y < img.h; y++) {
-    for (int x = 0; x < img.w; x++) {
-      // extract 'size' pixels of the column
-      // centered around (x,y)
-      for (int s = 0; s < size; s++) {
-        int yy = (y + s - size / 2 + img.h) % img.h;
-        pixels[s] = copy(x, yy);
+#pragma omp parallel for
+  for (int x = 0; x < img.w; x++) {
+    // sorted values of the 'size' pixels of the column centered around (x,y)
+    std::vector<T> window(size);
+    for (int s = 0; s < size; s++) {
+      int yy = ((s - size / 2) % img.h + img.h) % img.h;
+      window[s] = copy(x, yy);
+    }
+    std::sort(window.begin(), window.end());
+
+    for (int y = 0; y < img.h; y++) {
+      if (y > 0) {
+        // slide the window by one pixel
+        int out = ((y - 1 - size / 2) % img.h + img.h) % img.h;
+        int in = (y + size - 1 - size / 2) % img.h;
+        window.erase(
+            std::lower_bound(window.begin(), window.end(), copy(x, out)));
+        T v = copy(x, in);
+        window.insert(std::upper_bound(window.begin(), window.end(), v), v);
       }
 
-      // sort the value
-      std::sort(pixels.begin(), pixels.end());
-
       // save the median
       if (size % 2) {
-        img(x, y) = pixels[size / 2];
+        img(x, y) = window[size / 2];
       } else {
-        img(x, y) = (pixels[size / 2 - 1] + pixels[size / 2]) / 2.;
+        img(x, y) = (window[size / 2 - 1] + window[size / 2]) / 2.;
       }
     }
   }
@@ -226,29 +241,72 @@ static void initialSupportEstimation(std::vector<int>& support,
     support[j] = std::min_element(start, start + w / 2) - start;
   }
 
-  // apply the Lipschitz continuity constraint on the support
+  // apply the Lipschitz continuity constraint on the support: scanning the
+  // rows in order, a row whose support is below the bound propagated by the
+  // previous ones bounds every row at a circular distance d by
+  // support + d*maxSlope
+  // all these cones have the same slope, so the lowest one at a row is found
+  // with sliding window minimums (monotone deques of rows, whose cones are
+  // increasing at the current row) instead of propagating each of them
+  auto cone = [&](int j, int d) -> T { return support[j] + d * maxSlope; };
+  std::vector<char> propagates(h);
+  std::deque<int> window;
+
+  // rows propagating their cone: a row j' < j bounds j at the distance j - j'
+  // if it is at most h/2 (window), and h - (j - j') otherwise (wrapped, whose
+  // cones decrease as j increases, so only the lowest one is kept)
+  int wrapped = -1;
+  for (int j = 0; j < h; j++) {
+    int joining = j - h / 2 - 1;
+    if (joining >= 0 && propagates[joining]) {
+      if (wrapped < 0 || cone(joining, h - j + joining) <
+                             cone(wrapped, h - j + wrapped))
+        wrapped = joining;
+    }
+    while (!window.empty() && j - window.front() > h / 2) window.pop_front();
+
+    T currentMinimum = w / 2;
+    if (!window.empty())
+      currentMinimum =
+          std::min(currentMinimum, cone(window.front(), j - window.front()));
+    if (wrapped >= 0)
+      currentMinimum =
+          std::min(currentMinimum, cone(wrapped, h - j + wrapped));
+
+    if (support[j] < currentMinimum) {
+      propagates[j] = true;
+      while (!window.empty() &&
+             cone(window.back(), j - window.back()) >= support[j])
+        window.pop_back();
+      window.push_back(j);
+    }
+  }
+
+  // lowest cone at each row, from the rows on its left then on its right
+  // (positions are unrolled around the circle)
   std::vector<T> currentMinimums(h);
   std::fill(currentMinimums.begin(), currentMinimums.end(), w / 2);
-
-  for (int j = 0; j < h; j++) {
-    // if the support is lower than the current maximum, we apply the constraint
-    if (support[j] < currentMinimums[j]) {
-      currentMinimums[j] = support[j];
-
-      // propagate the constraint to other values (to both sides at the same
-      // time)
-      for (int yy = 1; yy <= h / 2; yy++) {
-        // minimum value that is allowed at a distance 'yy' from the current
-        // position
-        T minimumValue = support[j] + yy * maxSlope;
-
-        int prevRow = (j - yy + h) % h;
-        currentMinimums[prevRow] =
-            std::min(currentMinimums[prevRow], minimumValue);
-
-        int nextRow = (j + yy) % h;
-        currentMinimums[nextRow] =
-            std::min(currentMinimums[nextRow], minimumValue);
+  for (int direction : {1, -1}) {
+    window.clear();
+    int first = direction > 0 ? -(h / 2) : h - 1 + h / 2;
+    int last = direction > 0 ? h : -1;
+    for (int p = first; p != last; p += direction) {
+      int j = (p % h + h) % h;
+      if (propagates[j]) {
+        while (!window.empty() &&
+               cone((window.back() % h + h) % h,
+                    (p - window.back()) * direction) >= support[j])
+          window.pop_back();
+        window.push_back(p);
+      }
+      if (p < 0 || p >= h) continue;
+      while (!window.empty() && (p - window.front()) * direction > h / 2)
+        window.pop_front();
+      if (!window.empty()) {
+        currentMinimums[j] =
+            std::min(currentMinimums[j],
+                     cone((window.front() % h + h) % h,
+                          (p - window.front()) * direction));
       }
     }
   }
@@ -258,34 +316,213 @@ static void initialSupportEstimation(std::vector<int>& support,
   }
 }
 
-/// estimate the kernel from a blurred image and a kernel size
-/// Algorithm 1 of the paper
+/// angle set and autocorrelations of the projections of the whitened image
+/// (computed for a kernel size, or cropped from the ones of a larger size:
+/// the angle set of a kernel size is a subset of the ones of larger sizes)
+/// with an angle budget, only part of the angles of the set are projected
 template <typename T>
-void estimateKernel(img_t<T>& kernel, const img_t<T>& img, int kernelSize,
-                    const options& opts) {
-  kernel.ensure_size(kernelSize, kernelSize);
+struct projectionsAutocorrelations {
+  int kernelSize = 0;
+  std::vector<angle_t> angleSet;
+  img_t<T> acProjections;
+  int completeSize = 0;  // size of the complete angle set
+
+  void compute(const img_t<T>& grey, int kernelSize, T compensationFactor,
+               int angleBudget = 0) {
+    this->kernelSize = kernelSize;
+    angleSet.clear();
+    computeProjectionAngleSet(angleSet, kernelSize * 2);
+    completeSize = angleSet.size();
+    selectAngleBudget(angleSet, angleBudget);
+    computeProjectionsAutocorrelation(acProjections, grey, angleSet,
+                                      kernelSize * 2, compensationFactor);
+  }
 
-  // convert the image to greyscale
-  img_t<T> grey(img.w, img.h);
-  grey.greyfromcolor(img);
+  /// keep the angles of a smaller kernel size and the center of their
+  /// autocorrelations
+  void crop(projectionsAutocorrelations& out, int kernelSize) const {
+    assert(kernelSize <= this->kernelSize);
+    std::vector<angle_t> candidates;
+    computeProjectionAngleSet(candidates, kernelSize * 2);
+    out.kernelSize = kernelSize;
+    out.completeSize = candidates.size();
+
+    // both angle sets are sorted the same way (the angles missing from this
+    // one because of the budget are skipped)
+    std::vector<int> rows;
+    out.angleSet.clear();
+    unsigned row = 0;
+    for (const angle_t& angle : candidates) {
+      while (row < angleSet.size() && angleSet[row].angle > angle.angle) row++;
+      if (row < angleSet.size() && angleSet[row].x == angle.x &&
+          angleSet[row].y == angle.y) {
+        out.angleSet.push_back(angle);
+        rows.push_back(row);
+      }
+    }
 
-  // search a blurred patch which will be used for kernel evaluation
-  img_t<T> blurredPatch;
-  searchBlurredPatch(blurredPatch, grey, 150, 100);
+    int w = kernelSize * 4 + 1;
+    int offset = acProjections.w / 2 - w / 2;
+    out.acProjections.ensure_size(w, out.angleSet.size());
+    for (unsigned j = 0; j < out.angleSet.size(); j++) {
+      std::copy(&acProjections(offset, rows[j]),
+                &acProjections(offset + w, rows[j]), &out.acProjections(0, j));
+    }
+  }
 
-  // compute the angle set
-  std::vector<angle_t> angleSet;
-  computeProjectionAngleSet(angleSet, kernelSize * 2);
+  /// maximum slope of the support between two consecutive angles (see
+  /// initialSupportEstimation), larger when angles were left out so that it
+  /// stays the same per radian
+  T supportSlope() const {
+    return T(20. / 700.) *
+           (T(completeSize) / std::max<int>(angleSet.size(), 1));
+  }
+};
+
+/// smallest odd kernel size whose square has shear projections at least as
+/// wide as the given support of their autocorrelations (the projection of
+/// a k*k square along the angle (x,y) is k*(1+min(|x|,|y|)/max(|x|,|y|))
+/// wide, and its autocorrelation vanishes beyond that width minus one)
+static inline int kernelSizeFromSupport(const std::vector<int>& support,
+                                        const std::vector<angle_t>& angleSet) {
+  int kernelSize = 3;
+  for (unsigned j = 0; j < angleSet.size(); j++) {
+    int ax = std::abs(angleSet[j].x);
+    int ay = std::abs(angleSet[j].y);
+    double factor = double(std::min(ax, ay)) / std::max(ax, ay);
+    kernelSize = std::max(
+        kernelSize, (int)std::ceil((support[j] + 1) / (1. + factor)));
+  }
+  return kernelSize | 1;
+}
 
-  // compute the autocorrelation of the projection of the whitened image
-  img_t<T> acProjections;
-  computeProjectionsAutocorrelation(acProjections, grey, angleSet,
-                                    kernelSize * 2, opts.compensationFactor);
+/// largest difference between two supports
+static inline int supportDistance(const std::vector<int>& a,
+                                  const std::vector<int>& b) {
+  int distance = 0;
+  for (unsigned j = 0; j < a.size(); j++) {
+    distance = std::max(distance, std::abs(a[j] - b[j]));
+  }
+  return distance;
+}
+
+/// whether the kernel is close to a Dirac: one of its pixels has at least
+/// the fraction 'mass' of its mass (opts.diracMass)
+template <typename T>
+bool isNearlyDirac(const img_t<T>& kernel, T mass) {
+  return *std::max_element(kernel.data.begin(), kernel.data.end()) >= mass;
+}
+
+/// downsample the image by a factor 2 (average of 2x2 blocks)
+template <typename T>
+static void downsampleImage(img_t<T>& out, const img_t<T>& img) {
+  assert(img.d == 1);
+  out.ensure_size(img.w / 2, img.h / 2);
+  for (int y = 0; y < out.h; y++) {
+    for (int x = 0; x < out.w; x++) {
+      out(x, y) = (img(2 * x, 2 * y) + img(2 * x + 1, 2 * y) +
+                   img(2 * x, 2 * y + 1) + img(2 * x + 1, 2 * y + 1)) /
+                  T(4.);
+    }
+  }
+}
+
+/// upsample the kernel by a factor 2 to a kernel of size 'size' (bilinear
+/// interpolation, the centers of the two kernels are aligned)
+template <typename T>
+static void upsampleKernel(img_t<T>& out, const img_t<T>& kernel, int size) {
+  out.ensure_size(size, size);
+  for (int y = 0; y < size; y++) {
+    for (int x = 0; x < size; x++) {
+      T cx = (x - size / 2) / T(2.) + kernel.w / 2;
+      T cy = (y - size / 2) / T(2.) + kernel.h / 2;
+      int x0 = std::floor(cx);
+      int y0 = std::floor(cy);
+      T fx = cx - x0;
+      T fy = cy - y0;
+      T value = 0.;
+      for (int dy = 0; dy < 2; dy++) {
+        for (int dx = 0; dx < 2; dx++) {
+          if (kernel.inside(x0 + dx, y0 + dy)) {
+            value += (dx ? fx : T(1.) - fx) * (dy ? fy : T(1.) - fy) *
+                     kernel(x0 + dx, y0 + dy);
+          }
+        }
+      }
+      out(x, y) = std::max(value, T(0.));
+    }
+  }
+  out.normalize();
+}
+
+/// estimate the kernel from a greyscale blurred image, after a coarse
+/// estimation on the image downsampled by 2 if 'scales' > 1 (the upsampled
+/// coarse kernel gives the initial support and, with opts.warmStart, the
+/// phase of part of the first tries)
+/// the outer iterations are numbered from the ones of the coarser scales, so
+/// that each one draws different random phases
+/// the autocorrelations of the image can be given in 'precomputed' (for a
+/// larger kernel size), and when they are for this kernel size, the initial
+/// support already estimated from them in 'precomputedSupport'
+/// returns the number of outer iterations done so far
+template <typename T>
+static int estimateKernelAtScale(
+    img_t<T>& kernel, const img_t<T>& grey, int kernelSize,
+    const options& opts, runStats& stats, int scales,
+    const projectionsAutocorrelations<T>* precomputed = nullptr,
+    const std::vector<int>* precomputedSupport = nullptr) {
+  // coarse estimation
+  const int minimumKernelSize = 5;
+  int coarseKernelSize = (kernelSize / 2) | 1;
+  int firstRound = 0;
+  if (scales > 1 && coarseKernelSize >= minimumKernelSize) {
+    img_t<T> downsampled;
+    downsampleImage(downsampled, grey);
+    img_t<T> coarseKernel;
+    firstRound = estimateKernelAtScale(coarseKernel, downsampled,
+                                       coarseKernelSize, opts, stats,
+                                       scales - 1);
+    upsampleKernel(kernel, coarseKernel, kernelSize);
+  } else {
+    kernel.ensure_size(kernelSize, kernelSize);
+  }
+
+  // the patch search and the autocorrelations are independent: when called
+  // from a parallel region (see main), the search is a task run by another
+  // thread of the team while this one computes the projections (otherwise
+  // the task is run immediately)
+  img_t<T> blurredPatch;
+  projectionsAutocorrelations<T> autocorrelations;
+#pragma omp taskgroup
+  {
+    // search a blurred patch which will be used for kernel evaluation
+#pragma omp task shared(blurredPatch, grey)
+    searchBlurredPatch(blurredPatch, grey, std::min({150, grey.w, grey.h}),
+                       100);
+
+    // compute the angle set and the autocorrelation of the projection of the
+    // whitened image
+    if (precomputed) {
+      precomputed->crop(autocorrelations, kernelSize);
+    } else {
+      autocorrelations.compute(grey, kernelSize, opts.compensationFactor,
+                               opts.angleBudget);
+    }
+  }
+  const std::vector<angle_t>& angleSet = autocorrelations.angleSet;
+  const img_t<T>& acProjections = autocorrelations.acProjections;
   int acRadius = acProjections.w / 2;
 
   // initial support estimation
   std::vector<int> support;
-  initialSupportEstimation(support, acProjections);
+  if (firstRound > 0) {
+    reestimateKernelSupport(support, kernel, angleSet, acRadius);
+  } else if (precomputedSupport) {
+    support = *precomputedSupport;
+  } else {
+    initialSupportEstimation(support, acProjections,
+                             autocorrelations.supportSlope());
+  }
 
   // iterative estimation
   img_t<T> powerSpectrum;
@@ -300,9 +537,76 @@ void estimateKernel(img_t<T>& kernel, const img_t<T>& img, int kernelSize,
                              acRadius);
 
     // retrieve a kernel in spatial domain using the power spectrum
-    phaseRetrieval(kernel, blurredPatch, powerSpectrum, kernelSize, opts);
+    phaseRetrieval(kernel, blurredPatch, powerSpectrum, kernelSize, opts,
+                   firstRound + i, stats);
 
     // reestimate the kernel support
+    std::vector<int> previousSupport = support;
     reestimateKernelSupport(support, kernel, angleSet, acRadius);
+
+    // stop when the support did not change (by more than the tolerance):
+    // the next rounds would only draw other random phases
+    if (opts.supportTolerance >= 0 && i + 1 < opts.Nouter &&
+        supportDistance(support, previousSupport) <= opts.supportTolerance) {
+      stats.skippedOuterIterations += opts.Nouter - i - 1;
+      break;
+    }
+  }
+  return firstRound + opts.Nouter;
+}
+
+/// estimate the kernel from a blurred image and a kernel size
+/// Algorithm 1 of the paper
+/// with opts.scales > 1, the kernel is first estimated on downsampled images
+/// (coarse to fine)
+/// if kernelSize is 0, it is chosen from the initial support estimated with
+/// opts.maxKernelSize, whose autocorrelations are reused
+/// with opts.sharpSupport, the kernel is a Dirac without estimation if the
+/// initial support is small enough (sharp image)
+template <typename T>
+void estimateKernel(img_t<T>& kernel, const img_t<T>& img, int kernelSize,
+                    const options& opts, runStats& stats) {
+  // convert the image to greyscale
+  img_t<T> grey(img.w, img.h);
+  grey.greyfromcolor(img);
+
+  if (kernelSize > 0 && opts.sharpSupport < 0) {
+    estimateKernelAtScale(kernel, grey, kernelSize, opts, stats, opts.scales);
+    return;
   }
+
+  // initial support at full resolution, for the automatic kernel size and
+  // the triage (the autocorrelations are then reused by the estimation)
+  projectionsAutocorrelations<T> autocorrelations;
+  autocorrelations.compute(grey, kernelSize > 0 ? kernelSize
+                                                : opts.maxKernelSize,
+                           opts.compensationFactor, opts.angleBudget);
+  std::vector<int> support;
+  initialSupportEstimation(support, autocorrelations.acProjections,
+                           autocorrelations.supportSlope());
+
+  if (kernelSize == 0) {
+    kernelSize = std::min(
+        kernelSizeFromSupport(support, autocorrelations.angleSet),
+        opts.maxKernelSize);
+    stats.selectedKernelSize = kernelSize;
+  }
+
+  // triage: a support this small in every direction means that the image is
+  // not blurred, the kernel is a Dirac
+  int maxSupport = *std::max_element(support.begin(), support.end());
+  if (opts.sharpSupport >= 0 && maxSupport <= opts.sharpSupport) {
+    kernel.ensure_size(kernelSize, kernelSize);
+    kernel.set_value(0);
+    kernel(kernelSize / 2, kernelSize / 2) = 1;
+    stats.triage = "initial support of at most " + std::to_string(maxSupport) +
+                   " in every direction, no kernel estimation";
+    return;
+  }
+
+  // the support of the triage is the initial support of the estimation if
+  // the autocorrelations are not cropped to a smaller kernel size
+  estimateKernelAtScale(
+      kernel, grey, kernelSize, opts, stats, opts.scales, &autocorrelations,
+      kernelSize == autocorrelations.kernelSize ? &support : nullptr);
 }
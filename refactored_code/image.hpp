@@ -16,15 +16,53 @@
 
 #include "fftw_allocator.hpp"
 
-template <typename T>
-class img_t {
- public:
-  static void use_threading(int n) {
+/// number of threads of the FFTW plans, shared by all the images
+/// the plans of an image use the number given to img_t::set_fft_threads, or
+/// else the number given to img_t::use_threading
+namespace fftw_threads {
+inline int planner = 1;
+inline bool initialized = false;
+
+/// make the next plans use n threads (n <= 0 for 'planner')
+/// to call in the critical section fftw, like the planning
+inline void plan_with(int n) {
 #ifdef FFTW_HAS_THREADS
+  if (n <= 0) n = planner;
+  if (!initialized) {
     if (n <= 1) return;
     fftw_init_threads();
-    fftw_plan_with_nthreads(n);
+    fftwf_init_threads();
+    initialized = true;
+  }
+  fftw_plan_with_nthreads(n);
+  fftwf_plan_with_nthreads(n);
+#else
+  (void)n;
 #endif
+}
+}  // namespace fftw_threads
+
+template <typename T>
+class img_t {
+ public:
+  static void use_threading(int n) {
+#pragma omp critical(fftw)
+    {
+      fftw_threads::planner = std::max(n, 1);
+      fftw_threads::plan_with(0);
+    }
+  }
+
+  /// number of threads of the FFT plans of this image (0 for the number
+  /// given to use_threading)
+  /// the plans are recreated if it changes
+  /// a plan splits its transform in the same way whatever the number of
+  /// threads actually running it, but FFTW may choose a different plan for
+  /// a different number of threads
+  void set_fft_threads(int n) {
+    if (n == fft_threads) return;
+    fft_threads = n;
+    destroy_plans();
   }
 
   int w, h, d;
@@ -34,6 +72,7 @@ class img_t {
   fftw_plan backwardplan;
   fftwf_plan forwardplanf;
   fftwf_plan backwardplanf;
+  int fft_threads = 0;
 
   img_t()
       : w(0),
@@ -101,17 +140,30 @@ class img_t {
       this->d = d;
       size = w * h * d;
       data.resize(size);
+      destroy_plans();
+    }
+  }
 
-      if (forwardplan) {
+  void destroy_plans() {
+    if (forwardplan) {
 #pragma omp critical(fftw)
-        fftw_destroy_plan(forwardplan);
-        forwardplan = nullptr;
-      }
-      if (backwardplan) {
+      fftw_destroy_plan(forwardplan);
+      forwardplan = nullptr;
+    }
+    if (backwardplan) {
 #pragma omp critical(fftw)
-        fftw_destroy_plan(backwardplan);
-        backwardplan = nullptr;
-      }
+      fftw_destroy_plan(backwardplan);
+      backwardplan = nullptr;
+    }
+    if (forwardplanf) {
+#pragma omp critical(fftw)
+      fftwf_destroy_plan(forwardplanf);
+      forwardplanf = nullptr;
+    }
+    if (backwardplanf) {
+#pragma omp critical(fftw)
+      fftwf_destroy_plan(backwardplanf);
+      backwardplanf = nullptr;
     }
   }
 
@@ -178,8 +230,12 @@ class img_t {
       tmp.copy(*this);
       int n[] = {h, w};
 #pragma omp critical(fftw)
-      forwardplan = fftw_plan_many_dft(2, n, d, out, n, d, 1, out, n, d, 1,
-                                       FFTW_FORWARD, FFTW_ESTIMATE);
+      {
+        fftw_threads::plan_with(fft_threads);
+        forwardplan = fftw_plan_many_dft(2, n, d, out, n, d, 1, out, n, d, 1,
+                                         FFTW_FORWARD, FFTW_ESTIMATE);
+        fftw_threads::plan_with(0);
+      }
       copy(tmp);
     }
     this->copy(o);
@@ -198,8 +254,12 @@ class img_t {
       tmp.copy(*this);
       int n[] = {h, w};
 #pragma omp critical(fftw)
-      backwardplan = fftw_plan_many_dft(2, n, d, out, n, d, 1, out, n, d, 1,
-                                        FFTW_BACKWARD, FFTW_ESTIMATE);
+      {
+        fftw_threads::plan_with(fft_threads);
+        backwardplan = fftw_plan_many_dft(2, n, d, out, n, d, 1, out, n, d, 1,
+                                          FFTW_BACKWARD, FFTW_ESTIMATE);
+        fftw_threads::plan_with(0);
+      }
       copy(tmp);
     }
     double norm = w * h;
@@ -219,8 +279,12 @@ class img_t {
       tmp.copy(*this);
       int n[] = {h, w};
 #pragma omp critical(fftw)
-      forwardplanf = fftwf_plan_many_dft(2, n, d, out, n, d, 1, out, n, d, 1,
-                                         FFTW_FORWARD, FFTW_ESTIMATE);
+      {
+        fftw_threads::plan_with(fft_threads);
+        forwardplanf = fftwf_plan_many_dft(2, n, d, out, n, d, 1, out, n, d, 1,
+                                           FFTW_FORWARD, FFTW_ESTIMATE);
+        fftw_threads::plan_with(0);
+      }
       copy(tmp);
     }
     this->copy(o);
@@ -239,8 +303,12 @@ class img_t {
       tmp.copy(*this);
       int n[] = {h, w};
 #pragma omp critical(fftw)
-      backwardplanf = fftwf_plan_many_dft(2, n, d, out, n, d, 1, out, n, d, 1,
-                                          FFTW_BACKWARD, FFTW_ESTIMATE);
+      {
+        fftw_threads::plan_with(fft_threads);
+        backwardplanf = fftwf_plan_many_dft(2, n, d, out, n, d, 1, out, n, d, 1,
+                                            FFTW_BACKWARD, FFTW_ESTIMATE);
+        fftw_threads::plan_with(0);
+      }
       copy(tmp);
     }
     float norm = w * h;
@@ -11,6 +11,7 @@
 #include "iio.hpp"
 #include "image.hpp"
 #include "options.hpp"
+#include "stats.hpp"
 
 static options parse_args(int argc, char** argv) {
   args::ArgumentParser parser(
@@ -36,32 +37,183 @@ static options parse_args(int argc, char** argv) {
       "regularization weight for the kernel evaluation",
       {"lambda2"},
       flt(3000)};
+  args::Flag floatEvaluation{
+      parser,
+      "evalFloat",
+      "run the TV deconvolutions of the kernel evaluation in single "
+      "precision",
+      {"evalFloat"}};
+  args::Flag floatDeconvolution{
+      parser,
+      "deconvFloat",
+      "run the final TV deconvolution in single precision (half the memory "
+      "of the solver)",
+      {"deconvFloat"}};
   args::ValueFlag<int> Nouter{parser,
                               "Nouter",
                               "number of iterations of the support",
                               {'i', "Nouter"},
                               3};
+  args::ValueFlag<flt> supportTolerance{
+      parser,
+      "tolerance",
+      "stop the outer iterations when no value of the support changed by "
+      "more than this amount (0 to stop when it is identical, negative to "
+      "always run Nouter iterations)",
+      {"supportTol"},
+      flt(-1)};
   args::ValueFlag<int> Ninner{parser,
                               "Ninner",
                               "number of iterations of the phase retrieval",
                               {'p', "Ninner"},
                               300};
+  args::ValueFlag<flt> phaseRetrievalTolerance{
+      parser,
+      "tolerance",
+      "stop a phase retrieval try when its Fourier magnitude error improved "
+      "by less than this relative amount during a window (0 to always run "
+      "Ninner iterations)",
+      {"prTol"},
+      flt(0)};
+  args::ValueFlag<int> phaseRetrievalWindow{
+      parser,
+      "window",
+      "number of phase retrieval iterations between two convergence checks",
+      {"prWindow"},
+      10};
+  args::MapFlag<std::string, phaseRetrievalAlgorithm> phaseRetrievalMethod{
+      parser,
+      "algorithm",
+      "update rule of the phase retrieval: raar (relaxed averaged alternating "
+      "reflections with a fixed schedule of beta), raar-adaptive (beta driven "
+      "by the support error), hio (hybrid input-output) or dm (difference "
+      "map, twice the FFTs per iteration)",
+      {"prAlgo"},
+      {{"raar", phaseRetrievalAlgorithm::RAAR},
+       {"raar-adaptive", phaseRetrievalAlgorithm::adaptiveRAAR},
+       {"hio", phaseRetrievalAlgorithm::HIO},
+       {"dm", phaseRetrievalAlgorithm::differenceMap}},
+      phaseRetrievalAlgorithm::RAAR};
+  args::Flag floatPhaseRetrieval{
+      parser,
+      "prFloat",
+      "run the phase retrieval tries in single precision (the candidate "
+      "kernels are still evaluated in double precision, see --evalFloat)",
+      {"prFloat"}};
   args::ValueFlag<int> Ntries{parser,
                               "Ntries",
                               "number of tries of the phase retrieval",
                               {'t', "Ntries"},
                               30};
+  args::ValueFlag<int> raceRungs{
+      parser,
+      "rungs",
+      "number of successive halvings of the phase retrieval tries, ranked by "
+      "their Fourier magnitude error (0 to run and evaluate all the tries)",
+      {"race"},
+      0};
+  args::ValueFlag<int> evaluationTopM{
+      parser,
+      "M",
+      "score the candidate kernels with a one-shot Fourier deconvolution and "
+      "run the full TV deconvolution only on the M best (0 to evaluate all "
+      "the candidates with the TV deconvolution)",
+      {"topM"},
+      0};
+  args::ValueFlag<flt> surrogateWeight{
+      parser,
+      "weight",
+      "regularization weight of the one-shot deconvolution used by --topM",
+      {"surrogateWeight"},
+      flt(1e-2)};
+  args::ValueFlag<flt> warmStart{
+      parser,
+      "fraction",
+      "fraction of the phase retrieval tries started from the phase of the "
+      "previous outer iteration's kernel (0 to start all the tries from a "
+      "random phase)",
+      {"warmStart"},
+      flt(0)};
+  args::ValueFlag<int> warmNtries{
+      parser,
+      "Ntries",
+      "number of tries of the phase retrieval after the first outer "
+      "iteration, with --warmStart (0 to keep Ntries)",
+      {"warmTries"},
+      0};
+  args::ValueFlag<int> warmNinner{
+      parser,
+      "Ninner",
+      "number of iterations of the phase retrieval after the first outer "
+      "iteration, with --warmStart (0 to keep Ninner)",
+      {"warmInner"},
+      0};
+  args::ValueFlag<int> scales{
+      parser,
+      "scales",
+      "number of scales of the coarse to fine estimation: the kernel is "
+      "first estimated on the image downsampled by 2 with a kernel of half "
+      "the size, which gives the initial support (and, with --warmStart, the "
+      "initial phase) of the finer scale (1 for a single scale)",
+      {"scales"},
+      1};
+  args::ValueFlag<flt> cacheTolerance{
+      parser,
+      "tolerance",
+      "candidate kernels differing by at most this value at every pixel "
+      "from an already evaluated one reuse its score instead of being "
+      "evaluated (0 to only skip exact duplicates)",
+      {"cacheTol"},
+      flt(0)};
   args::ValueFlag<bool> medianFilter{
       parser,
       "medianFilter",
       "apply the median filtering to the autocorrelations",
       {'m', "median"},
       true};
+  args::ValueFlag<int> angleBudget{
+      parser,
+      "angles",
+      "project the image along at most this number of angles, spread over "
+      "the half circle (favoring the ones giving the most samples of the "
+      "power spectrum); the missing samples are interpolated (0 to use all "
+      "the angles)",
+      {"angleBudget"},
+      0};
+  args::ValueFlag<int> sharpSupport{
+      parser,
+      "support",
+      "triage of sharp images: if the initial support is at most this value "
+      "in every direction, the kernel is a Dirac without estimation, and the "
+      "final deconvolution is skipped when the kernel is close to a Dirac "
+      "(negative to disable)",
+      {"sharpSupport"},
+      -1};
+  args::ValueFlag<flt> diracMass{
+      parser,
+      "mass",
+      "with the triage of sharp images, the kernel is close to a Dirac if one "
+      "of its pixels has at least this fraction of its mass",
+      {"diracMass"},
+      flt(0.9)};
+  args::ValueFlag<int> maxKernelSize{
+      parser,
+      "size",
+      "largest kernel size considered by the automatic kernel size (should "
+      "be odd)",
+      {"maxKernelSize"},
+      31};
+  args::Flag verbose{parser,
+                     "verbose",
+                     "print statistics about the estimation",
+                     {'v', "verbose"}};
   args::Positional<std::string> input{
       parser, "input", "input blurry image file", args::Options::Required};
-  args::Positional<int> kernelSize{parser, "kernelSize",
-                                   "kernel size (should be odd)",
-                                   args::Options::Required};
+  args::Positional<std::string> kernelSize{
+      parser, "kernelSize",
+      "kernel size (should be odd), or 'auto' to choose it from the "
+      "estimated support (up to --maxKernelSize)",
+      args::Options::Required};
   args::Positional<std::string> out_kernel{
       parser, "out_kernel", "kernel output file", args::Options::Required};
   args::Positional<std::string> out_deconv{
@@ -82,44 +234,76 @@ static options parse_args(int argc, char** argv) {
     exit(1);
   }
 
-  if (args::get(kernelSize) % 2 == 0) {
-    std::cerr << "Error: kernelSize (argument 2) has to be odd." << std::endl;
+  // 0 for the automatic kernel size
+  int size = 0;
+  if (args::get(kernelSize) != "auto") {
+    try {
+      size = std::stoi(args::get(kernelSize));
+    } catch (const std::exception&) {
+      size = 0;
+    }
+    if (size <= 0 || size % 2 == 0) {
+      std::cerr << "Error: kernelSize (argument 2) has to be odd or 'auto'."
+                << std::endl;
+      exit(1);
+    }
+  }
+  if (args::get(maxKernelSize) <= 0 || args::get(maxKernelSize) % 2 == 0) {
+    std::cerr << "Error: maxKernelSize has to be odd." << std::endl;
     exit(1);
   }
 
   options opts{};
   opts.Ninner = args::get(Ninner);
+  opts.phaseRetrievalTolerance = args::get(phaseRetrievalTolerance);
+  opts.phaseRetrievalWindow = args::get(phaseRetrievalWindow);
+  opts.phaseRetrievalMethod = args::get(phaseRetrievalMethod);
+  opts.floatPhaseRetrieval = args::get(floatPhaseRetrieval);
   opts.Nouter = args::get(Nouter);
+  opts.supportTolerance = args::get(supportTolerance);
+  opts.warmStart = args::get(warmStart);
+  opts.warmNtries = args::get(warmNtries);
+  opts.warmNinner = args::get(warmNinner);
+  opts.scales = args::get(scales);
   opts.Ntries = args::get(Ntries);
+  opts.raceRungs = args::get(raceRungs);
+  opts.evaluationTopM = args::get(evaluationTopM);
+  opts.surrogateWeight = args::get(surrogateWeight);
+  opts.cacheTolerance = args::get(cacheTolerance);
   opts.medianFilter = args::get(medianFilter);
   opts.compensationFactor = args::get(compensationFactor);
   opts.finalDeconvolutionWeight = args::get(finalDeconvolutionWeight);
   opts.intermediateDeconvolutionWeight =
       args::get(intermediateDeconvolutionWeight);
+  opts.floatEvaluation = args::get(floatEvaluation);
+  opts.floatDeconvolution = args::get(floatDeconvolution);
   opts.seed = args::get(seed);
+  opts.verbose = args::get(verbose);
   opts.input = args::get(input);
-  opts.kernelSize = args::get(kernelSize);
+  opts.kernelSize = size;
+  opts.maxKernelSize = args::get(maxKernelSize);
+  opts.angleBudget = args::get(angleBudget);
+  opts.sharpSupport = args::get(sharpSupport);
+  opts.diracMass = args::get(diracMass);
   opts.out_kernel = args::get(out_kernel);
   opts.out_deconv = args::get(out_deconv);
   return opts;
 }
 
 int main(int argc, char** argv) {
+  struct options opts = parse_args(argc, argv);
+
 #ifdef _OPENMP
-  const int max_threads = omp_get_max_threads();
-#else
-  const int max_threads = 1;
+  // the estimation runs in a small team of independent stages (see below),
+  // and the phase retrieval tries split their loops and their FFTs over
+  // nested teams when the cores outnumber them (see teamSize)
+  omp_set_max_active_levels(3);
 #endif
 
-  img_t<flt>::use_threading(max_threads);
-
-  struct options opts = parse_args(argc, argv);
-
-  if (opts.seed != -1) {
-    srand(opts.seed);
-  } else {
-    srand(time(nullptr));
+  if (opts.seed == -1) {
+    opts.seed = time(nullptr);
   }
+  srand(opts.seed);
 
   // read the input image
   int w = 0, h = 0, d = 0;
@@ -133,19 +317,72 @@ int main(int argc, char** argv) {
   for (int i = 0; i < img.size; i++) img[i] /= max;
 
   // estimate the kernel (call Algorithm 1 of the paper)
+  // the stages that do not depend on the kernel are tasks run by a second
+  // thread while this one estimates it: the padding of the full image for
+  // the final deconvolution (when the kernel size is given) and the search
+  // of the blurred patch (see estimateKernelAtScale)
   img_t<flt> kernel;
-  estimateKernel(kernel, img, opts.kernelSize, opts);
+  img_t<flt> padded;
+  runStats stats;
+#ifdef _OPENMP
+  const int stageThreads = std::min(2, omp_get_max_threads());
+#endif
+#pragma omp parallel num_threads(stageThreads)
+#pragma omp single
+  {
+    if (opts.kernelSize > 0) {
+#pragma omp task shared(padded, img)
+      pad_for_kernel(padded, img, opts.kernelSize);
+    }
+    estimateKernel(kernel, img, opts.kernelSize, opts, stats);
+#pragma omp taskwait
+  }
+
+  // deconvolving with a Dirac would only denoise the image
+  const bool deconvolve =
+      opts.sharpSupport < 0 || !isNearlyDirac(kernel, flt(opts.diracMass));
+  if (!deconvolve) {
+    if (!stats.triage.empty()) stats.triage += "; ";
+    stats.triage += "kernel close to a Dirac, no deconvolution";
+  }
+  if (opts.verbose) stats.print(std::cerr);
 
   // save the estimated kernel
   iio_write_image(opts.out_kernel, &kernel[0], kernel.w, kernel.h, kernel.d);
 
+  // the transforms of the estimation are only threaded within the nested
+  // teams of the tries (see phaseRetrievalTry::setThreads): the others are
+  // threaded from the final deconvolution on
+#ifdef _OPENMP
+  const int max_threads = omp_get_max_threads();
+#else
+  const int max_threads = 1;
+#endif
+
+  img_t<flt>::use_threading(max_threads);
+
   // deconvolve the blurry image using the estimated kernel
   img_t<flt> result;
-  img_t<flt> tapered;
-  img_t<flt> deconv;
-  pad_and_taper(tapered, img, kernel);
-  deconvBregman(deconv, tapered, kernel, 20, opts.finalDeconvolutionWeight);
-  unpad(result, deconv, kernel);
+  if (deconvolve) {
+    img_t<flt> tapered;
+    img_t<flt> deconv;
+    if (padded.size > 0 && std::max(kernel.w, kernel.h) == opts.kernelSize) {
+      taper_padded(tapered, padded, kernel);
+    } else {
+      pad_and_taper(tapered, img, kernel);
+    }
+    if (opts.floatDeconvolution) {
+      deconvBregmanWithPrecision<float>(deconv, tapered, kernel, 20,
+                                        opts.finalDeconvolutionWeight,
+                                        flt(400.), nullptr, max_threads);
+    } else {
+      deconvBregman(deconv, tapered, kernel, 20, opts.finalDeconvolutionWeight,
+                    flt(400.), nullptr, max_threads);
+    }
+    unpad(result, deconv, kernel);
+  } else {
+    result = img;
+  }
 
   // clamp the result and restore the original range
   for (int i = 0; i < result.size; i++)
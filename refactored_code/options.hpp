@@ -5,19 +5,42 @@
 // TODO: Set it as a proper type name
 using flt = double;
 
+/// update rule of the phase retrieval (see phaseRetrievalTry::iterate)
+enum class phaseRetrievalAlgorithm { RAAR, adaptiveRAAR, HIO, differenceMap };
+
 struct options {
   std::string input;
-  int kernelSize;
+  int kernelSize;  // 0 to choose it automatically
+  int maxKernelSize;
+  int angleBudget;
+  int sharpSupport;
+  flt diracMass;
   std::string out_kernel;
   std::string out_deconv;
 
   int Ninner;
+  flt phaseRetrievalTolerance;
+  int phaseRetrievalWindow;
+  phaseRetrievalAlgorithm phaseRetrievalMethod;
+  bool floatPhaseRetrieval;
   int Ntries;
+  int raceRungs;
+  int evaluationTopM;
+  flt surrogateWeight;
+  flt cacheTolerance;
   int Nouter;
+  flt supportTolerance;
+  flt warmStart;
+  int warmNtries;
+  int warmNinner;
+  int scales;
   flt compensationFactor;
   int medianFilter;
 
   flt finalDeconvolutionWeight;
   flt intermediateDeconvolutionWeight;
+  bool floatEvaluation;
+  bool floatDeconvolution;
   int seed;
+  bool verbose;
 };
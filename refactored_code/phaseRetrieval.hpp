@@ -1,92 +1,416 @@
 #pragma once
 
+#include <atomic>
 #include <cassert>
 #include <cmath>
 #include <complex>
+#include <limits>
+#include <numeric>
+#include <type_traits>
+#include <vector>
+#ifdef _OPENMP
+#include <omp.h>
+#endif
 
 #include "deconvBregman.hpp"
 #include "image.hpp"
 #include "options.hpp"
+#include "rng.hpp"
+#include "scoreCache.hpp"
+#include "stats.hpp"
 
-/// Algorithm 6
+/// relative error between the Fourier magnitude of the kernel estimate
+/// contained in 'g' (positive part of its kernelSize*kernelSize corner) and
+/// the target magnitude
 template <typename T>
-static void singlePhaseRetrieval(img_t<T>& kernel, const img_t<T>& magnitude,
-                                 int kernelSize, int nbIterations) {
-  using complex = std::complex<T>;
-  static const complex I(0, 1);
+static T kernelMagnitudeError(const img_t<T>& g, const img_t<T>& magnitude,
+                              int kernelSize,
+                              img_t<std::complex<T>>& kernelft) {
+  kernelft.ensure_size(g.w, g.h);
+  kernelft.set_value(0);
+  for (int y = 0; y < kernelSize; y++)
+    for (int x = 0; x < kernelSize; x++)
+      kernelft(x, y) = std::max(g(x, y), T(0.));
+  kernelft.fft(kernelft);
+
+  T error = 0.;
+  T norm = 0.;
+  for (int i = 0; i < kernelft.size; i++) {
+    T diff = std::abs(kernelft[i]) - magnitude[i];
+    error += diff * diff;
+    norm += magnitude[i] * magnitude[i];
+  }
+  return std::sqrt(error / norm);
+}
 
-  kernel.ensure_size(kernelSize, kernelSize);
-  kernel.set_value(0);
+/// number of Fourier transforms of one iteration of the phase retrieval
+static inline int transformsPerIteration(phaseRetrievalAlgorithm algorithm) {
+  return algorithm == phaseRetrievalAlgorithm::differenceMap ? 4 : 2;
+}
+
+/// one try of the phase retrieval (Algorithm 6)
+/// the state is kept between calls to iterate() so that a try can be run in
+/// several chunks
+template <typename T>
+struct phaseRetrievalTry {
+  using complex = std::complex<T>;
 
-  const T alpha = 0.95;
-  const T beta0 = 0.75;
+  // relaxation of the magnitude projection
+  static constexpr T alpha = 0.95;
+  // initial beta of RAAR (both schedules)
+  static constexpr T beta0 = 0.75;
+  // fixed beta of HIO and of the difference map
+  static constexpr T betaHIO = 0.9;
+  static constexpr T betaDM = 0.8;
 
-  img_t<complex> ftkernel(magnitude.w, magnitude.h);
-  img_t<T> g(magnitude.w, magnitude.h);
-  img_t<complex> gft(g.w, g.h, g.d);
-  img_t<T> g2(g);
-  img_t<T> R(g);
-  img_t<char> omega(g.w, g.h);  // can't use bool because of std::vector
+  img_t<T> g;
+  img_t<T> g2;
+  img_t<complex> gft;
+  img_t<complex> kernelft;
+  phaseRetrievalAlgorithm algorithm = phaseRetrievalAlgorithm::RAAR;
+  int m = 0;  // number of iterations done so far
+  int threads = 1;  // size of the team (see setThreads)
+  bool converged = false;
+  T bestError = std::numeric_limits<T>::max();
+  // adaptive RAAR: current beta and support error after the first iteration
+  T beta = beta0;
+  T initialSupportError = 0;
+  std::vector<T> rowErrors;
 
-  for (int i = 0; i < ftkernel.size; i++) {
-    T phase = ((T)rand() / RAND_MAX) * M_PI * 2 - M_PI;
-    ftkernel[i] = magnitude[i] * std::exp(I * phase);
-  }
-  ftkernel.ifft(ftkernel);
-  for (int i = 0; i < g.size; i++) {
-    g[i] = std::real(ftkernel[i]);
+  /// run the pointwise loops and the Fourier transforms over a team of 'n'
+  /// threads (the plans of the transforms depend on 'n', see
+  /// img_t::set_fft_threads)
+  void setThreads(int n) {
+    threads = n;
+    gft.set_fft_threads(n);
+    kernelft.set_fft_threads(n);
   }
 
-  for (int m = 0; m < nbIterations; m++) {
-    T beta = beta0 +
-             (T(1.) - beta0) * (T(1.) - std::exp(-std::pow(m / T(7.), T(3.))));
+  /// start from the given magnitude with a random phase drawn from 'rng'
+  /// if 'phase' is given, start from it with a random perturbation of
+  /// amplitude 'jitter' (warm start)
+  void init(const img_t<T>& magnitude, rngStream rng,
+            const img_t<T>* phase = nullptr, T jitter = 0) {
+    static const complex I(0, 1);
+
+    g.ensure_size(magnitude.w, magnitude.h);
+    g2.ensure_size(g.w, g.h);
+    gft.ensure_size(g.w, g.h);
+    m = 0;
+    converged = false;
+    bestError = std::numeric_limits<T>::max();
+    beta = beta0;
+    initialSupportError = 0;
 
+    for (int i = 0; i < gft.size; i++) {
+      T phi = T(rng.uniform()) * M_PI * 2 - M_PI;
+      if (phase) phi = (*phase)[i] + phi * (jitter / T(M_PI));
+      gft[i] = magnitude[i] * std::exp(I * phi);
+    }
+    gft.ifft(gft);
     for (int i = 0; i < g.size; i++) {
-      gft[i] = g[i];
+      g[i] = std::real(gft[i]);
+    }
+  }
+
+  /// iterate until 'nbIterations' iterations were done in total
+  /// every 'window' iterations, the Fourier magnitude error of the estimate is
+  /// measured and the iterations stop early if it improved by less than
+  /// 'tolerance' (relative) during the window (tolerance = 0 disables it)
+  /// the update rule is chosen by 'algorithm'; in all of them, g2 is the
+  /// estimate with the target magnitude from which the kernel is extracted
+  void iterate(const img_t<T>& magnitude, int kernelSize, int nbIterations,
+               T tolerance = 0, int window = 1) {
+    while (m < nbIterations && !converged) {
+#pragma omp parallel for num_threads(threads) if (threads > 1)
+      for (int i = 0; i < g.size; i++) {
+        gft[i] = g[i];
+      }
+      projectMagnitude(magnitude);
+
+      switch (algorithm) {
+        case phaseRetrievalAlgorithm::RAAR:
+          reflect(kernelSize,
+                  beta0 + (T(1.) - beta0) *
+                              (T(1.) - std::exp(-std::pow(m / T(7.), T(3.)))));
+          break;
+        case phaseRetrievalAlgorithm::adaptiveRAAR:
+          reflect(kernelSize, beta);
+          adaptBeta(kernelSize);
+          break;
+        case phaseRetrievalAlgorithm::HIO:
+          hybridInputOutput(kernelSize, betaHIO);
+          break;
+        case phaseRetrievalAlgorithm::differenceMap:
+          differenceMap(magnitude, kernelSize, betaDM);
+          break;
+      }
+      m++;
+
+      // stop when the error did not decrease enough during the last window
+      if (tolerance > T(0.) && m % std::max(window, 1) == 0) {
+        T error = kernelMagnitudeError(g2, magnitude, kernelSize, kernelft);
+        if (error > bestError * (T(1.) - tolerance)) converged = true;
+        bestError = std::min(bestError, error);
+      }
     }
+  }
+
+  /// relaxed projection of the real part of gft on the signals with the
+  /// target Fourier magnitude, in place: z = fft(x) is replaced by
+  /// (alpha*magnitude + (1-alpha)*|z|) * exp(i*arg(z))
+  ///   = z * (alpha*magnitude/|z| + 1-alpha)
+  /// which only needs one reciprocal square root (z = 0 has phase 0)
+  void projectMagnitude(const img_t<T>& magnitude) {
     gft.fft(gft);
 
+    T* z = reinterpret_cast<T*>(&gft[0]);
+#pragma omp parallel for simd num_threads(threads) if (threads > 1)
     for (int i = 0; i < gft.size; i++) {
-      gft[i] = (alpha * magnitude[i] + (T(1.) - alpha) * std::abs(gft[i])) *
-               std::exp(I * std::arg(gft[i]));
+      T re = z[2 * i];
+      T im = z[2 * i + 1];
+      T norm = re * re + im * im;
+      T invAbs = norm > T(0.) ? T(1.) / std::sqrt(norm) : T(0.);
+      T scale = alpha * magnitude[i] * invAbs + (T(1.) - alpha);
+      z[2 * i] = norm > T(0.) ? re * scale : alpha * magnitude[i];
+      z[2 * i + 1] = im * scale;
     }
 
     gft.ifft(gft);
-    for (int i = 0; i < g.size; i++) {
-      g2[i] = std::real(gft[i]);
+  }
+
+  // the constraints are the support, the kernelSize*kernelSize corner (the
+  // first kernelSize columns of the first kernelSize rows), and positivity
+  // the update rules below go through g row by row, with the projection of g
+  // on the magnitudes in the real part of gft
+
+  /// RAAR: reflection where the estimate is negative or outside of the support
+  void reflect(int kernelSize, T beta) {
+    const T* z = reinterpret_cast<const T*>(&gft[0]);
+#pragma omp parallel for num_threads(threads) if (threads > 1)
+    for (int y = 0; y < g.h; y++) {
+      const int supportWidth = y < kernelSize ? kernelSize : 0;
+      const T* zy = z + 2 * y * g.w;
+      T* gy = &g[y * g.w];
+      T* g2y = &g2[y * g.w];
+#pragma omp simd
+      for (int x = 0; x < g.w; x++) {
+        T v = gy[x];
+        T v2 = zy[2 * x];
+        T reflected = beta * v + (T(1.) - T(2.) * beta) * v2;
+        g2y[x] = v2;
+        gy[x] = x >= supportWidth || T(2.) * v2 - v < T(0.) ? reflected : v2;
+      }
     }
+  }
 
-    for (int i = 0; i < R.size; i++) {
-      R[i] = T(2.) * g2[i] - g[i];
+  /// HIO: negative feedback where the projection violates the constraints
+  void hybridInputOutput(int kernelSize, T beta) {
+    const T* z = reinterpret_cast<const T*>(&gft[0]);
+#pragma omp parallel for num_threads(threads) if (threads > 1)
+    for (int y = 0; y < g.h; y++) {
+      const int supportWidth = y < kernelSize ? kernelSize : 0;
+      const T* zy = z + 2 * y * g.w;
+      T* gy = &g[y * g.w];
+      T* g2y = &g2[y * g.w];
+#pragma omp simd
+      for (int x = 0; x < g.w; x++) {
+        T v = gy[x];
+        T v2 = zy[2 * x];
+        g2y[x] = v2;
+        gy[x] = x >= supportWidth || v2 < T(0.) ? v - beta * v2 : v2;
+      }
     }
-    for (int i = 0; i < omega.size; i++) {
-      omega[i] = R[i] < T(0.);
+  }
+
+  /// difference map (Elser) with gamma_S = -1/beta and gamma_M = 1/beta:
+  ///   g += beta * (P_S(f_M(g)) - P_M(f_S(g)))
+  /// with f_M(g) = P_M(g) + (P_M(g) - g)/beta
+  /// and  f_S(g) = P_S(g) - (P_S(g) - g)/beta
+  /// it needs a second magnitude projection, for P_M(f_S(g))
+  void differenceMap(const img_t<T>& magnitude, int kernelSize, T beta) {
+    T* z = reinterpret_cast<T*>(&gft[0]);
+
+    // g2 = P_S(f_M(g)), and gft = f_S(g)
+#pragma omp parallel for num_threads(threads) if (threads > 1)
+    for (int y = 0; y < g.h; y++) {
+      const int supportWidth = y < kernelSize ? kernelSize : 0;
+      T* zy = z + 2 * y * g.w;
+      const T* gy = &g[y * g.w];
+      T* g2y = &g2[y * g.w];
+#pragma omp simd
+      for (int x = 0; x < g.w; x++) {
+        T v = gy[x];
+        T v2 = zy[2 * x];
+        T fm = v2 + (v2 - v) / beta;
+        g2y[x] = x >= supportWidth || fm < T(0.) ? T(0.) : fm;
+        zy[2 * x] = x >= supportWidth || v < T(0.) ? v / beta : v;
+        zy[2 * x + 1] = T(0.);
+      }
     }
 
-    for (int y = 0; y < magnitude.h; y++)
-      for (int x = kernelSize; x < magnitude.w; x++) {
-        omega(x, y) = true;
+    projectMagnitude(magnitude);
+
+    // g += beta * (g2 - gft), then g2 = P_M(f_S(g)) is the estimate
+#pragma omp parallel for num_threads(threads) if (threads > 1)
+    for (int y = 0; y < g.h; y++) {
+      const T* zy = z + 2 * y * g.w;
+      T* gy = &g[y * g.w];
+      T* g2y = &g2[y * g.w];
+#pragma omp simd
+      for (int x = 0; x < g.w; x++) {
+        T v2 = zy[2 * x];
+        gy[x] += beta * (g2y[x] - v2);
+        g2y[x] = v2;
       }
-    for (int y = kernelSize; y < magnitude.h; y++)
-      for (int x = 0; x < magnitude.w; x++) {
-        omega(x, y) = true;
+    }
+  }
+
+  /// adaptive RAAR: beta grows from beta0 to 1 as the support error of the
+  /// estimate decreases relatively to its value after the first iteration
+  /// (so that the iterations explore while the estimate is far from the
+  /// constraints and settle once it satisfies them)
+  void adaptBeta(int kernelSize) {
+    T error = supportError(kernelSize);
+    if (m == 0) initialSupportError = error;
+    T progress = initialSupportError > T(0.)
+                     ? T(1.) - std::min(error / initialSupportError, T(1.))
+                     : T(1.);
+    beta = std::max(beta, beta0 + (T(1.) - beta0) * progress);
+  }
+
+  /// relative energy of the estimate g2 outside of the constraints
+  /// the sums are done by rows, so that the result does not depend on the
+  /// number of threads
+  T supportError(int kernelSize) {
+    rowErrors.resize(2 * g.h);
+#pragma omp parallel for num_threads(threads) if (threads > 1)
+    for (int y = 0; y < g.h; y++) {
+      const int supportWidth = y < kernelSize ? kernelSize : 0;
+      const T* g2y = &g2[y * g.w];
+      T outside = 0.;
+      T total = 0.;
+#pragma omp simd reduction(+ : outside, total)
+      for (int x = 0; x < g.w; x++) {
+        T v2 = g2y[x];
+        total += v2 * v2;
+        outside += x >= supportWidth || v2 < T(0.) ? v2 * v2 : T(0.);
       }
+      rowErrors[2 * y] = outside;
+      rowErrors[2 * y + 1] = total;
+    }
 
-    for (int i = 0; i < g.size; i++) {
-      g[i] = omega[i] ? beta * g[i] + (T(1.) - T(2.) * beta) * g2[i] : g2[i];
+    T outside = 0.;
+    T total = 0.;
+    for (int y = 0; y < g.h; y++) {
+      outside += rowErrors[2 * y];
+      total += rowErrors[2 * y + 1];
     }
+    return total > T(0.) ? outside / total : T(0.);
   }
 
-  for (int y = 0; y < kernelSize; y++)
-    for (int x = 0; x < kernelSize; x++)
-      kernel(x, y) = g2(x, y) >= T(0.) ? g2(x, y) : T(0.);
-  kernel.normalize();
+  /// Fourier magnitude error of the current estimate
+  T error(const img_t<T>& magnitude, int kernelSize) {
+    return kernelMagnitudeError(g2, magnitude, kernelSize, kernelft);
+  }
+
+  /// extract the current kernel estimate
+  /// the kernel can be of a higher precision than the try: it is normalized
+  /// and thresholded in its own precision
+  template <typename K>
+  void getKernel(img_t<K>& kernel, int kernelSize) const {
+    kernel.ensure_size(kernelSize, kernelSize);
+    for (int y = 0; y < kernelSize; y++)
+      for (int x = 0; x < kernelSize; x++)
+        kernel(x, y) = g2(x, y) >= T(0.) ? K(g2(x, y)) : K(0.);
+    kernel.normalize();
+
+    // apply the thresholding of 1/255
+    for (int i = 0; i < kernel.size; i++) {
+      kernel[i] = kernel[i] < K(1. / 255.) ? K(0.) : kernel[i];
+    }
+    kernel.normalize();
+  }
+};
+
+/// initial state of the tries of one outer iteration: their update rule and
+/// their initial phase
+/// the first 'nbWarm' tries start from the Fourier phase of the kernel of the
+/// previous outer iteration (warm start), perturbed by a random phase whose
+/// amplitude grows with the try index; the other tries start from a uniformly
+/// random phase
+template <typename T>
+struct phaseRetrievalStart {
+  phaseRetrievalAlgorithm algorithm;
+  uint64_t seed;
+  int round;
+  img_t<T> phase;
+  int nbWarm = 0;
+
+  phaseRetrievalStart(const options& opts, int round)
+      : algorithm(opts.phaseRetrievalMethod), seed(opts.seed), round(round) {}
+
+  /// random stream of the k-th try
+  /// it only depends on the seed, the outer iteration and the try index, so
+  /// the tries draw the same random phases whatever the number of threads
+  rngStream stream(int k) const {
+    return rngStream(seed, ((uint64_t)round << 32) | (uint32_t)k);
+  }
+
+  /// warm start the first 'nbWarm' tries from the given kernel
+  template <typename K>
+  void warm(const img_t<K>& kernel, int w, int h, int nbWarm) {
+    img_t<std::complex<T>> kernelft(w, h);
+    kernelft.set_value(0);
+    for (int y = 0; y < kernel.h; y++)
+      for (int x = 0; x < kernel.w; x++) kernelft(x, y) = kernel(x, y);
+    kernelft.fft(kernelft);
 
-  // apply the thresholding of 1/255
-  for (int i = 0; i < kernel.size; i++) {
-    kernel[i] = kernel[i] < T(1. / 255.) ? T(0.) : kernel[i];
+    phase.ensure_size(w, h);
+    for (int i = 0; i < phase.size; i++) phase[i] = std::arg(kernelft[i]);
+    this->nbWarm = nbWarm;
   }
-  kernel.normalize();
+
+  void init(phaseRetrievalTry<T>& pr, const img_t<T>& magnitude,
+            int k) const {
+    pr.algorithm = algorithm;
+    if (k < nbWarm)
+      pr.init(magnitude, stream(k), &phase, T(M_PI) * k / nbWarm);
+    else
+      pr.init(magnitude, stream(k));
+  }
+};
+
+/// size of the team of threads of each of 'nbTasks' concurrent tasks
+/// when the cores outnumber the tasks, each task splits its pointwise loops
+/// and its FFTs over a nested team, so that the whole machine is used
+/// the team size is 1 (and the result is the same whatever the number of
+/// threads) as long as the tasks outnumber the cores; beyond that, the FFT
+/// plans, hence the last bits of the kernel, depend on the team size
+static inline int teamSize(int nbTasks) {
+#ifdef _OPENMP
+  return std::max(1, omp_get_max_threads() / std::max(nbTasks, 1));
+#else
+  (void)nbTasks;
+  return 1;
+#endif
+}
+
+/// Algorithm 6 (k-th try)
+/// see phaseRetrievalTry::iterate for the early termination
+/// returns the number of iterations actually used
+template <typename T, typename K>
+static int singlePhaseRetrieval(img_t<K>& kernel, const img_t<T>& magnitude,
+                                int kernelSize, int nbIterations,
+                                const phaseRetrievalStart<T>& start, int k,
+                                T tolerance = 0, int window = 1,
+                                int threads = 1) {
+  phaseRetrievalTry<T> pr;
+  pr.setThreads(threads);
+  start.init(pr, magnitude, k);
+  pr.iterate(magnitude, kernelSize, nbIterations, tolerance, window);
+  pr.getKernel(kernel, kernelSize);
+  return pr.m;
 }
 
 /// center the kernel at the center of the image
@@ -115,20 +439,10 @@ static void centerKernel(img_t<T>& kernel) {
   }
 }
 
-/// evaluate a kernel on a given blurry subimage
+/// score of a deconvolved patch: ratio between the l1 and l2 norm of its
+/// gradient (lower is sharper)
 template <typename T>
-static T evaluateKernel(const img_t<T>& kernel, const img_t<T>& blurredPatch,
-                        T deconvLambda) {
-  assert(blurredPatch.d == 1);
-
-  // pad and deconvolve the patch
-  img_t<T> paddedBlurredPatch;
-  pad_and_taper(paddedBlurredPatch, blurredPatch, kernel);
-  img_t<T> deconvPadded;
-  deconvBregman(deconvPadded, paddedBlurredPatch, kernel, 10, deconvLambda);
-  img_t<T> deconv;
-  unpad(deconv, deconvPadded, kernel);
-
+static T gradientSparsityScore(const img_t<T>& deconv) {
   // compute the l1 and l2 norm of the gradient of the deconvolved patch
   T normL1 = 0.;
   T normL2p2 = 0.;
@@ -146,66 +460,512 @@ static T evaluateKernel(const img_t<T>& kernel, const img_t<T>& blurredPatch,
   return normL1 / std::sqrt(normL2p2);
 }
 
-/// Algorithm 5
+/// evaluate kernels of the same size on a given blurry subimage
+/// everything that depends only on the patch and the kernel size is computed
+/// once: the padded patch, the weights of edgetaper, the Fourier transform of
+/// the padded patch, and the buffers, plans and laplacian part of the TV
+/// deconvolution (a tvreg context per concurrent evaluation)
+/// with 'floatDeconvolution', the TV deconvolution of evaluate() runs in
+/// single precision
+/// evaluate() can be called concurrently from several threads
 template <typename T>
-void phaseRetrieval(img_t<T>& outkernel, const img_t<T>& blurredPatch,
-                    const img_t<T>& powerSpectrum, int kernelSize,
-                    const options& opts) {
-  img_t<T> magnitude(powerSpectrum.w, powerSpectrum.h);
+class patchEvaluator {
+ public:
+  patchEvaluator(const img_t<T>& blurredPatch, int kernelWidth,
+                 int kernelHeight, T deconvLambda, int threads = 1,
+                 bool floatDeconvolution = false)
+      : padding(std::max(kernelWidth, kernelHeight)),
+        deconvLambda(deconvLambda),
+        threads(threads),
+        floatDeconvolution(floatDeconvolution) {
+    assert(blurredPatch.d == 1);
+    padimage_replicate(padded, blurredPatch, padding);
+    edgetaperWeights(weights, padded.w, padded.h, kernelWidth, kernelHeight);
+    padded_ft.ensure_size(padded.w, padded.h);
+    padded_ft.copy(padded);
+    padded_ft.fft(padded_ft);
+  }
+
+  ~patchEvaluator() {
+    for (auto* context : doubleContexts) tvreg<double>::freeContext(context);
+    for (auto* context : singleContexts) tvreg<float>::freeContext(context);
+  }
+
+  patchEvaluator(const patchEvaluator&) = delete;
+  patchEvaluator& operator=(const patchEvaluator&) = delete;
+
+  /// score of a kernel: the patch is tapered and deconvolved with the kernel,
+  /// then scored by gradientSparsityScore
+  T evaluate(const img_t<T>& kernel) const {
+    // taper and deconvolve the patch
+    img_t<T> paddedBlurredPatch;
+    edgetaper(paddedBlurredPatch, padded, padded_ft, weights, kernel, 4);
+    img_t<T> deconvPadded;
+    if (floatDeconvolution) {
+      deconvolve<float>(deconvPadded, paddedBlurredPatch, kernel);
+    } else {
+      deconvolve<T>(deconvPadded, paddedBlurredPatch, kernel);
+    }
+    img_t<T> deconv;
+    unpadimage(deconv, deconvPadded, padding);
+
+    return gradientSparsityScore(deconv);
+  }
+
+  /// cheap approximation of evaluate(): the patch is deconvolved in one
+  /// shot with a Tikhonov (Wiener-like) filter in the Fourier domain
+  /// K^* F / (|K|^2 + weight |D|^2), where |D|^2 is the symbol of the
+  /// laplacian, after a single pass of edgetaper
+  T evaluateWiener(const img_t<T>& kernel, T weight) const {
+    img_t<T> tapered;
+    edgetaper(tapered, padded, padded_ft, weights, kernel, 1);
+
+    int w = tapered.w;
+    int h = tapered.h;
+    img_t<std::complex<T>> kernel_ft(w, h);
+    kernel_ft.padcirc(kernel);
+    kernel_ft.fft(kernel_ft);
+    img_t<std::complex<T>> deconv_ft(w, h);
+    deconv_ft.copy(tapered);
+    deconv_ft.fft(deconv_ft);
+
+    for (int y = 0; y < h; y++) {
+      for (int x = 0; x < w; x++) {
+        T laplacian = T(2.) * (T(2.) - std::cos(T(2. * M_PI) * x / w) -
+                               std::cos(T(2. * M_PI) * y / h));
+        std::complex<T> k = kernel_ft(x, y);
+        deconv_ft(x, y) *= std::conj(k) / (std::norm(k) + weight * laplacian);
+      }
+    }
+    deconv_ft.ifft(deconv_ft);
+
+    img_t<T> deconvPadded(w, h);
+    for (int i = 0; i < deconvPadded.size; i++)
+      deconvPadded[i] = std::real(deconv_ft[i]);
+    img_t<T> deconv;
+    unpadimage(deconv, deconvPadded, padding);
+
+    return gradientSparsityScore(deconv);
+  }
+
+ private:
+  /// TV deconvolution of the tapered patch, computed in S
+  template <typename S>
+  void deconvolve(img_t<T>& deconvPadded, const img_t<T>& tapered,
+                  const img_t<T>& kernel) const {
+    typename tvreg<S>::context* context = acquireContext<S>();
+    deconvBregmanWithPrecision<S>(deconvPadded, tapered, kernel, 10,
+                                  deconvLambda, T(400.), context, threads);
+    releaseContext<S>(context);
+  }
+
+  /// the unused contexts of the tvreg instance computing in S
+  template <typename S>
+  std::vector<typename tvreg<S>::context*>& contexts() const {
+    if constexpr (std::is_same_v<S, float>) {
+      return singleContexts;
+    } else {
+      return doubleContexts;
+    }
+  }
+
+  /// a context unused by the other evaluations (created on demand)
+  template <typename S>
+  typename tvreg<S>::context* acquireContext() const {
+    typename tvreg<S>::context* context = nullptr;
+#pragma omp critical(patchEvaluator)
+    if (!contexts<S>().empty()) {
+      context = contexts<S>().back();
+      contexts<S>().pop_back();
+    }
+    if (!context) context = tvreg<S>::newContext(padded.w, padded.h, 1);
+    return context;
+  }
+
+  template <typename S>
+  void releaseContext(typename tvreg<S>::context* context) const {
+    if (!context) return;
+#pragma omp critical(patchEvaluator)
+    contexts<S>().push_back(context);
+  }
+
+  int padding;
+  T deconvLambda;
+  int threads;
+  bool floatDeconvolution;
+  img_t<T> padded;
+  img_t<T> weights;
+  img_t<std::complex<T>> padded_ft;
+  mutable std::vector<tvreg<double>::context*> doubleContexts;
+  mutable std::vector<tvreg<float>::context*> singleContexts;
+};
+
+/// rotate the kernel by 180 degrees
+template <typename T>
+static void mirrorKernel(img_t<T>& mirror, const img_t<T>& kernel) {
+  mirror.ensure_size(kernel.w, kernel.h);
+  for (int y = 0; y < kernel.h; y++) {
+    for (int x = 0; x < kernel.w; x++) {
+      mirror(x, y) = kernel(kernel.w - 1 - x, kernel.h - 1 - y);
+    }
+  }
+}
+
+/// the candidate kernels of a set of kernels: the kernels and their mirrors
+/// (because the phase retrieval can't distinguish between a kernel and its
+/// mirror), candidates 2k and 2k+1 being the k-th kernel and its mirror
+template <typename T>
+static std::vector<img_t<T>> kernelsAndMirrors(
+    const std::vector<img_t<T>>& kernels) {
+  std::vector<img_t<T>> candidates(2 * kernels.size());
+  for (unsigned k = 0; k < kernels.size(); k++) {
+    candidates[2 * k] = kernels[k];
+    mirrorKernel(candidates[2 * k + 1], kernels[k]);
+  }
+  return candidates;
+}
+
+/// evaluate the kernels and their mirrors (see kernelsAndMirrors)
+/// candidates identical to a previous one reuse its score
+/// the best candidate (lowest score, then lowest index) is written to
+/// 'outkernel' and its score returned
+template <typename T>
+static T evaluateKernelsAndMirrors(img_t<T>& outkernel,
+                                   const std::vector<img_t<T>>& kernels,
+                                   const patchEvaluator<T>& evaluator,
+                                   scoreCache<T>& cache, runStats& stats) {
+  int n = kernels.size();
+  std::vector<img_t<T>> candidates = kernelsAndMirrors(kernels);
+  std::vector<char> unique(2 * n);
+  for (int c = 0; c < 2 * n; c++) {
+    unique[c] = cache.claim(candidates[c]);
+  }
+
+  std::vector<T> scores(2 * n);
+#pragma omp parallel for schedule(dynamic)
+  for (int c = 0; c < 2 * n; c++) {
+    if (unique[c]) {
+      scores[c] = evaluator.evaluate(candidates[c]);
+      cache.set(candidates[c], scores[c]);
+    }
+  }
+  for (int c = 0; c < 2 * n; c++) {
+    if (!unique[c]) {
+      scores[c] = cache.get(candidates[c]);
+      stats.cachedEvaluations++;
+    }
+  }
+
+  int best = std::min_element(scores.begin(), scores.end()) - scores.begin();
+  outkernel = candidates[best];
+  return scores[best];
+}
+
+/// multi-fidelity evaluation of a set of kernels and their mirrors (see
+/// kernelsAndMirrors): all of them are scored with
+/// patchEvaluator::evaluateWiener, and only the 'topM' best go through the
+/// full evaluation
+/// candidates identical to a previous one are skipped
+/// the best refined candidate (lowest score, then lowest index, as in
+/// evaluateKernelsAndMirrors) is written to 'outkernel' and its score returned
+template <typename T>
+static T evaluateKernelsMultiFidelity(img_t<T>& outkernel,
+                                      const std::vector<img_t<T>>& kernels,
+                                      const patchEvaluator<T>& evaluator,
+                                      scoreCache<T>& cache,
+                                      const options& opts, runStats& stats) {
+  int n = kernels.size();
+  std::vector<img_t<T>> candidates = kernelsAndMirrors(kernels);
+  std::vector<int> order;
+  for (int c = 0; c < 2 * n; c++) {
+    if (cache.claim(candidates[c])) order.push_back(c);
+  }
+  int nbUnique = order.size();
+  stats.cachedEvaluations += 2 * n - nbUnique;
+
+  std::vector<T> surrogateScores(2 * n);
+#pragma omp parallel for
+  for (int i = 0; i < nbUnique; i++) {
+    surrogateScores[order[i]] =
+        evaluator.evaluateWiener(candidates[order[i]], T(opts.surrogateWeight));
+  }
+
+  // rank by the surrogate score and refine the best ones
+  std::stable_sort(order.begin(), order.end(), [&](int a, int b) {
+    return surrogateScores[a] < surrogateScores[b];
+  });
+  int m = std::max(1, std::min(opts.evaluationTopM, nbUnique));
+  std::vector<T> scores(m);
+#pragma omp parallel for
+  for (int i = 0; i < m; i++) {
+    scores[i] = evaluator.evaluate(candidates[order[i]]);
+  }
+  int best = 0;
+  for (int i = 1; i < m; i++) {
+    if (scores[i] < scores[best] ||
+        (scores[i] == scores[best] && order[i] < order[best])) {
+      best = i;
+    }
+  }
+  outkernel = candidates[order[best]];
+
+  // measure how much the surrogate ranking disagrees with the full one
+  stats.surrogateEvaluations += nbUnique;
+  stats.fullEvaluations += m;
+  stats.surrogateRankings++;
+  if (best != 0) stats.surrogateBestMismatches++;
+  for (int i = 0; i < m; i++) {
+    for (int j = i + 1; j < m; j++) {
+      stats.surrogateComparedPairs++;
+      if (scores[j] < scores[i]) stats.surrogateDiscordantPairs++;
+    }
+  }
+
+  return scores[best];
+}
+
+/// run the tries of the phase retrieval as a successive halving race:
+/// all the tries are run for a fraction of the iterations, ranked by the
+/// Fourier magnitude error of their estimate, and only the best half continues
+/// returns the indices of the tries which reached the end of the race
+template <typename T>
+static std::vector<int> racePhaseRetrieval(
+    std::vector<phaseRetrievalTry<T>>& tries, const img_t<T>& magnitude,
+    const phaseRetrievalStart<T>& start, int kernelSize, int Ninner,
+    const options& opts) {
+  const T tolerance = opts.phaseRetrievalTolerance;
+  const int rungs = opts.raceRungs;
+
+  std::vector<int> survivors(tries.size());
+  std::iota(survivors.begin(), survivors.end(), 0);
+
+  for (unsigned k = 0; k < tries.size(); k++) {
+    start.init(tries[k], magnitude, k);
+  }
+
+  std::vector<T> errors(tries.size());
+  for (int r = 0; r < rungs && survivors.size() > 1; r++) {
+    int nbIterations = (long)Ninner * (r + 1) / (rungs + 1);
+    int threads = teamSize(survivors.size());
+
+#pragma omp parallel for
+    for (int s = 0; s < (int)survivors.size(); s++) {
+      int k = survivors[s];
+      tries[k].setThreads(threads);
+      tries[k].iterate(magnitude, kernelSize, nbIterations, tolerance,
+                       opts.phaseRetrievalWindow);
+      errors[k] = tries[k].error(magnitude, kernelSize);
+    }
+
+    // keep the best half
+    std::stable_sort(survivors.begin(), survivors.end(),
+                     [&](int a, int b) { return errors[a] < errors[b]; });
+    survivors.resize((survivors.size() + 1) / 2);
+  }
+
+  // the survivors finish their iterations
+  int threads = teamSize(survivors.size());
+#pragma omp parallel for
+  for (int s = 0; s < (int)survivors.size(); s++) {
+    tries[survivors[s]].setThreads(threads);
+    tries[survivors[s]].iterate(magnitude, kernelSize, Ninner, tolerance,
+                                opts.phaseRetrievalWindow);
+  }
+
+  std::sort(survivors.begin(), survivors.end());
+  return survivors;
+}
+
+/// record the iterations of the tries of one outer iteration, the Fourier
+/// transforms they used and the score of the selected kernel
+template <typename T>
+static void recordPhaseRetrieval(runStats& stats,
+                                 const std::vector<int>& iterations,
+                                 phaseRetrievalAlgorithm algorithm, T score) {
+  long total = std::accumulate(iterations.begin(), iterations.end(), 0L);
+  stats.phaseRetrievalIterations.push_back(iterations);
+  stats.phaseRetrievalTransforms.push_back(total *
+                                           transformsPerIteration(algorithm));
+  stats.kernelScores.push_back(score);
+}
+
+/// Algorithm 5, with the tries of the phase retrieval run in precision R
+/// the candidate kernels are extracted, centered and evaluated in precision T
+template <typename T, typename R>
+static void phaseRetrievalWithPrecision(img_t<T>& outkernel,
+                                        const img_t<T>& blurredPatch,
+                                        const img_t<T>& powerSpectrum,
+                                        int kernelSize, const options& opts,
+                                        int round, runStats& stats) {
+  img_t<R> magnitude(powerSpectrum.w, powerSpectrum.h);
   for (int i = 0; i < powerSpectrum.size; i++)
-    magnitude[i] = std::sqrt(powerSpectrum[i]);
+    magnitude[i] = R(std::sqrt(powerSpectrum[i]));
   magnitude.ifftshift();  // unshift the magnitude
 
-  T globalCurrentScore = std::numeric_limits<T>::max();
+  phaseRetrievalStart<R> start(opts, round);
+  int Ntries = opts.Ntries;
+  int Ninner = opts.Ninner;
+  if (round > 0 && opts.warmStart > 0 && outkernel.w == kernelSize &&
+      outkernel.h == kernelSize) {
+    if (opts.warmNtries > 0) Ntries = opts.warmNtries;
+    if (opts.warmNinner > 0) Ninner = opts.warmNinner;
+    int nbWarm = std::clamp((int)std::lround(opts.warmStart * Ntries), 1,
+                            Ntries);
+    start.warm(outkernel, magnitude.w, magnitude.h, nbWarm);
+  }
+
+  std::vector<int> iterations(Ntries);
+
+  // precompute everything that depends only on the blurred patch
+  // (up to 2*Ntries evaluations run concurrently)
+  patchEvaluator<T> evaluator(blurredPatch, kernelSize, kernelSize,
+                              T(opts.intermediateDeconvolutionWeight),
+                              teamSize(2 * Ntries), opts.floatEvaluation);
+
+  // identical (or, with opts.cacheTolerance, near) candidates are only
+  // evaluated once
+  scoreCache<T> cache(opts.cacheTolerance);
+
+  if (opts.raceRungs > 0 || opts.evaluationTopM > 0) {
+    // retrieve the candidate kernels
+    std::vector<img_t<T>> kernels;
+    if (opts.raceRungs > 0) {
+      std::vector<phaseRetrievalTry<R>> tries(Ntries);
+      std::vector<int> survivors =
+          racePhaseRetrieval(tries, magnitude, start, kernelSize, Ninner, opts);
+      for (int k = 0; k < Ntries; k++) {
+        iterations[k] = tries[k].m;
+      }
+      kernels.resize(survivors.size());
+      for (unsigned s = 0; s < survivors.size(); s++) {
+        tries[survivors[s]].getKernel(kernels[s], kernelSize);
+      }
+    } else {
+      kernels.resize(Ntries);
+#pragma omp parallel for
+      for (int k = 0; k < Ntries; k++) {
+        iterations[k] = singlePhaseRetrieval(
+            kernels[k], magnitude, kernelSize, Ninner, start, k,
+            R(opts.phaseRetrievalTolerance), opts.phaseRetrievalWindow,
+            teamSize(Ntries));
+      }
+    }
+    for (img_t<T>& kernel : kernels) {
+      centerKernel(kernel);
+    }
+
+    // evaluate the candidates
+    T score;
+    if (opts.evaluationTopM > 0) {
+      score = evaluateKernelsMultiFidelity(outkernel, kernels, evaluator, cache,
+                                           opts, stats);
+    } else {
+      score =
+          evaluateKernelsAndMirrors(outkernel, kernels, evaluator, cache, stats);
+    }
+    recordPhaseRetrieval(stats, iterations, opts.phaseRetrievalMethod, score);
+    return;
+  }
+
+  // pipeline of tasks: each retrieval task produces a kernel and its mirror
+  // (candidates 2k and 2k+1), and the evaluation of the claimed candidates is
+  // spawned as tasks, so that the threads stay busy whatever the number of
+  // tries
+  // the candidates are claimed in index order, as in the other paths: a
+  // finished try only claims the candidates of the finished tries that follow
+  // all the previous ones, so that which candidate of a group of near ones is
+  // evaluated does not depend on the order in which the tries finish
+  // a candidate near an already claimed one is not evaluated: its score is
+  // copied once all the tasks are done
+  std::vector<img_t<T>> candidates(2 * Ntries);
+  std::vector<T> scores(2 * Ntries);
+  std::vector<char> unique(2 * Ntries);
+  std::vector<char> retrieved(Ntries);
+  int nextClaim = 0;  // first try whose candidates are not claimed yet
+
+  // index of the best candidate so far, updated with a compare-and-swap
+  // ties between scores are broken by the index of the candidate, so that the
+  // result does not depend on the order in which the tasks finish (a copied
+  // score ties with the one of the lower claimed candidate it comes from,
+  // which is then selected)
+  std::atomic<int> best(-1);
+  auto offer = [&](int c) {
+    int b = best.load();
+    while ((b < 0 || scores[c] < scores[b] ||
+            (scores[c] == scores[b] && c < b)) &&
+           !best.compare_exchange_weak(b, c)) {
+    }
+  };
+
 #pragma omp parallel
-  {
-    img_t<T> kernel;
-    img_t<T> kernel_mirror;
-    T currentScore = std::numeric_limits<T>::max();
-    img_t<T> bestKernel;
-#pragma omp for nowait
-    for (int k = 0; k < opts.Ntries; k++) {
+#pragma omp single
+  for (int k = 0; k < Ntries; k++) {
+#pragma omp task firstprivate(k)
+    {
       // retrieve one possible kernel
-      singlePhaseRetrieval(kernel, magnitude, kernelSize, opts.Ninner);
+      img_t<T>& kernel = candidates[2 * k];
+      iterations[k] = singlePhaseRetrieval(
+          kernel, magnitude, kernelSize, Ninner, start, k,
+          R(opts.phaseRetrievalTolerance), opts.phaseRetrievalWindow,
+          teamSize(Ntries));
       centerKernel(kernel);
+      mirrorKernel(candidates[2 * k + 1], kernel);
 
-      // mirror the kernel (because the phase retrieval can't distinguish
-      // between the kernel and its mirror)
-      kernel_mirror.ensure_size(kernel.w, kernel.h);
-      for (int y = 0; y < kernel.h; y++) {
-        for (int x = 0; x < kernel.w; x++) {
-          kernel_mirror(x, y) = kernel(kernel.w - 1 - x, kernel.h - 1 - y);
+      // claim the candidates of the tries retrieved in order so far
+      std::vector<int> claimed;
+#pragma omp critical(claimCandidates)
+      {
+        retrieved[k] = 1;
+        for (; nextClaim < Ntries && retrieved[nextClaim]; nextClaim++) {
+          for (int c = 2 * nextClaim; c < 2 * nextClaim + 2; c++) {
+            unique[c] = cache.claim(candidates[c]);
+            if (unique[c]) claimed.push_back(c);
+          }
         }
       }
 
-      // evaluate the two kernels
-      img_t<T>* kernels[2] = {&kernel, &kernel_mirror};
-      T scores[2];
-      for (int i = 0; i < 2; i++) {
-        scores[i] = evaluateKernel(*(kernels[i]), blurredPatch,
-                                   opts.intermediateDeconvolutionWeight);
-      }
-
-      // keep the best one
-      if (scores[1] < scores[0]) {
-        scores[0] = scores[1];
-        kernels[0] = kernels[1];
-      }
-
-      // if the best of two is better than the current best, keep it
-      if (scores[0] < currentScore) {
-        currentScore = scores[0];
-        bestKernel = *(kernels[0]);
+      // and evaluate them
+      for (int c : claimed) {
+#pragma omp task firstprivate(c)
+        {
+          scores[c] = evaluator.evaluate(candidates[c]);
+          cache.set(candidates[c], scores[c]);
+          offer(c);
+        }
       }
     }
+  }
 
-    // aggregate results by keeping the best kernel
-#pragma omp critical
-    {
-      if (currentScore < globalCurrentScore) {
-        globalCurrentScore = currentScore;
-        outkernel = bestKernel;
-      }
+  for (int c = 0; c < 2 * Ntries; c++) {
+    if (!unique[c]) {
+      scores[c] = cache.get(candidates[c]);
+      stats.cachedEvaluations++;
+      offer(c);
     }
   }
+
+  outkernel = candidates[best];
+  recordPhaseRetrieval(stats, iterations, opts.phaseRetrievalMethod,
+                       scores[best]);
+}
+
+/// Algorithm 5
+/// 'round' is the index of the outer iteration, used to draw different random
+/// phases at each call
+/// with opts.warmStart, the outer iterations after the first start part of
+/// their tries from the kernel of the previous one (or the upsampled kernel
+/// of the coarser scale), given in 'outkernel'
+/// with opts.floatPhaseRetrieval, the tries run in single precision
+template <typename T>
+void phaseRetrieval(img_t<T>& outkernel, const img_t<T>& blurredPatch,
+                    const img_t<T>& powerSpectrum, int kernelSize,
+                    const options& opts, int round, runStats& stats) {
+  if (opts.floatPhaseRetrieval) {
+    phaseRetrievalWithPrecision<T, float>(outkernel, blurredPatch,
+                                          powerSpectrum, kernelSize, opts,
+                                          round, stats);
+  } else {
+    phaseRetrievalWithPrecision<T, T>(outkernel, blurredPatch, powerSpectrum,
+                                      kernelSize, opts, round, stats);
+  }
 }
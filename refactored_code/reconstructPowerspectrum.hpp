@@ -1,12 +1,18 @@
 #pragma once
 
+#include <algorithm>
+#include <cmath>
 #include <cstdlib>
+#include <vector>
 
 #include "angleSet.hpp"
 #include "image.hpp"
 
 /// reconstruct the power spectrum from a set of autocorrelations of projections
 /// each projection is used to reconstruct one or more coefficients
+/// the coefficients that no projection reaches (when the angle set is not
+/// complete, see selectAngleBudget) are interpolated from the slices of the
+/// two closest angles
 template <typename T>
 void reconstructPowerspectrum(img_t<T>& powerSpectrum,
                               const img_t<T> acProjections,
@@ -17,6 +23,9 @@ void reconstructPowerspectrum(img_t<T>& powerSpectrum,
 
   img_t<std::complex<T>> ftAutocorrelation(acProjections.w, 1);
   img_t<T> powerSpectrumSlice(acProjections.w, 1);
+  img_t<T> slices(acProjections.w, angleSet.size());
+  img_t<char> reached(powerSpectrum.w, powerSpectrum.h);
+  reached.set_value(0);
 
   for (unsigned j = 0; j < angleSet.size(); j++) {
     // compute the discrete Fourier transform of the autocorrelation
@@ -49,6 +58,63 @@ void reconstructPowerspectrum(img_t<T>& powerSpectrum,
           powerSpectrumSlice[psSize + sliceOffset];
       powerSpectrum(psSize - xOffset, psSize - yOffset) =
           powerSpectrumSlice[psSize + sliceOffset];
+      reached(psSize + xOffset, psSize + yOffset) = 1;
+      reached(psSize - xOffset, psSize - yOffset) = 1;
+    }
+
+    std::copy(&powerSpectrumSlice[0], &powerSpectrumSlice[0] + slices.w,
+              &slices(0, j));
+  }
+
+  // angles of the slices in increasing order
+  std::vector<std::pair<T, int>> order;
+  for (unsigned j = 0; j < angleSet.size(); j++) {
+    order.emplace_back(std::atan2(T(angleSet[j].y), T(angleSet[j].x)), j);
+  }
+  std::sort(order.begin(), order.end());
+
+  // value of the slice j at the euclidean distance rho of the center:
+  // the slice is sampled at the grid points i*(x,y), at the offset
+  // i*max(|x|,|y|) (linear interpolation between the samples)
+  auto sliceValue = [&](int j, T rho) {
+    T x = angleSet[j].x;
+    T y = angleSet[j].y;
+    T offset = rho * std::max(std::abs(x), std::abs(y)) / std::hypot(x, y);
+    offset = std::min(offset, T(psSize));
+    int i = std::min((int)offset, psSize - 1);
+    T f = offset - i;
+    return (T(1.) - f) * slices(psSize + i, j) + f * slices(psSize + i + 1, j);
+  };
+
+  for (int y = -psSize; y <= psSize && !order.empty(); y++) {
+    for (int x = -psSize; x <= psSize; x++) {
+      if (reached(psSize + x, psSize + y) || (x == 0 && y == 0)) continue;
+
+      // the power spectrum is symmetric: use the angle in (-pi/2, pi/2]
+      T theta = std::atan2(T(y), T(x));
+      if (theta > T(M_PI / 2)) theta -= T(M_PI);
+      if (theta <= T(-M_PI / 2)) theta += T(M_PI);
+
+      // closest angles on both sides (around the half circle)
+      auto next = std::lower_bound(order.begin(), order.end(),
+                                   std::make_pair(theta, -1));
+      std::pair<T, int> above =
+          next == order.end()
+              ? std::make_pair(order.front().first + T(M_PI),
+                               order.front().second)
+              : *next;
+      std::pair<T, int> below =
+          next == order.begin()
+              ? std::make_pair(order.back().first - T(M_PI),
+                               order.back().second)
+              : *(next - 1);
+
+      T rho = std::hypot(T(x), T(y));
+      T span = above.first - below.first;
+      T f = span > T(0.) ? (theta - below.first) / span : T(0.);
+      powerSpectrum(psSize + x, psSize + y) =
+          (T(1.) - f) * sliceValue(below.second, rho) +
+          f * sliceValue(above.second, rho);
     }
   }
 
@@ -0,0 +1,31 @@
+#pragma once
+
+#include <cstdint>
+
+/// counter-based random number stream (splitmix64 applied to a counter)
+/// the n-th number of the stream (seed, id) only depends on seed, id and n,
+/// so that each parallel try draws the same numbers whatever the thread
+/// scheduling or the number of threads
+class rngStream {
+ public:
+  rngStream(uint64_t seed, uint64_t id)
+      : key(mix(seed + mix(id + golden))), counter(0) {}
+
+  /// next 64 bits of the stream
+  uint64_t next() { return mix(key + (++counter) * golden); }
+
+  /// uniform value in [0, 1)
+  double uniform() { return (next() >> 11) * (1. / 9007199254740992.); }
+
+ private:
+  static constexpr uint64_t golden = 0x9e3779b97f4a7c15ULL;
+
+  static uint64_t mix(uint64_t z) {
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+    return z ^ (z >> 31);
+  }
+
+  uint64_t key;
+  uint64_t counter;
+};
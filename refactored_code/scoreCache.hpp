@@ -0,0 +1,121 @@
+#pragma once
+
+#include <cmath>
+#include <cstdint>
+#include <unordered_map>
+#include <vector>
+
+#include "image.hpp"
+
+/// scores of the candidate kernels of one phase retrieval, so that identical
+/// or nearly identical candidates (duplicates, or a symmetric kernel and its
+/// mirror) are only evaluated once
+/// the candidates are canonical before they are claimed (centered, see
+/// centerKernel), so that a duplicate has the same values
+/// with a zero tolerance, a candidate hits the cache if a kernel with the
+/// same values was claimed before: the kernels are found by the hash of their
+/// values
+/// with a positive tolerance, a candidate hits the cache if a kernel of the
+/// same size claimed before differs from it by at most 'tolerance' at every
+/// pixel: the score of a hit is the score of that kernel, which is near the
+/// candidate but not necessarily equal to it
+/// a hash of quantized values would miss near kernels on both sides of a
+/// quantization step, so the claimed kernels are then compared one by one
+/// (there are at most two candidates per try)
+/// the candidates themselves are never modified; with a positive tolerance,
+/// which candidate of a group of near ones is evaluated depends on the order
+/// of the claims, hence the claims in candidate index order of
+/// phaseRetrieval
+/// the cache can be shared by concurrent evaluations
+template <typename T>
+class scoreCache {
+ public:
+  explicit scoreCache(T tolerance = 0) : tolerance(tolerance) {}
+
+  /// returns true if no kernel near this one was claimed before: the caller
+  /// then has to evaluate it and set() its score
+  /// otherwise, the score is available with get() once it was set
+  bool claim(const img_t<T>& kernel) {
+    bool claimed;
+#pragma omp critical(scoreCache)
+    {
+      claimed = find(kernel) < 0;
+      if (claimed) {
+        entries.push_back(
+            {kernel.w, kernel.h,
+             std::vector<T>(kernel.data.begin(), kernel.data.end()), T(0.)});
+        if (tolerance <= T(0.)) {
+          byHash.emplace(hash(kernel), entries.size() - 1);
+        }
+      }
+    }
+    return claimed;
+  }
+
+  void set(const img_t<T>& kernel, T score) {
+#pragma omp critical(scoreCache)
+    entries[find(kernel)].score = score;
+  }
+
+  /// score of the kernel claimed near this one
+  T get(const img_t<T>& kernel) const {
+    T score;
+#pragma omp critical(scoreCache)
+    score = entries[find(kernel)].score;
+    return score;
+  }
+
+ private:
+  /// only the values are kept (an img_t copy would share its fft plans)
+  struct entry {
+    int w, h;
+    std::vector<T> data;
+    T score;
+  };
+
+  /// index of the first claimed kernel near this one, or -1
+  int find(const img_t<T>& kernel) const {
+    if (tolerance <= T(0.)) {
+      auto range = byHash.equal_range(hash(kernel));
+      for (auto it = range.first; it != range.second; ++it) {
+        if (near(entries[it->second], kernel)) return it->second;
+      }
+      return -1;
+    }
+    for (unsigned e = 0; e < entries.size(); e++) {
+      if (near(entries[e], kernel)) return e;
+    }
+    return -1;
+  }
+
+  bool near(const entry& a, const img_t<T>& b) const {
+    if (a.w != b.w || a.h != b.h) return false;
+    for (int i = 0; i < b.size; i++) {
+      if (!(std::abs(a.data[i] - b[i]) <= tolerance)) return false;
+    }
+    return true;
+  }
+
+  /// FNV-1a hash of the size and of the bytes of the values
+  static uint64_t hash(const img_t<T>& kernel) {
+    uint64_t h = 0xcbf29ce484222325ULL;
+    auto add = [&](const void* data, size_t size) {
+      const unsigned char* bytes = static_cast<const unsigned char*>(data);
+      for (size_t i = 0; i < size; i++) {
+        h = (h ^ bytes[i]) * 0x100000001b3ULL;
+      }
+    };
+    add(&kernel.w, sizeof(kernel.w));
+    add(&kernel.h, sizeof(kernel.h));
+    for (int i = 0; i < kernel.size; i++) {
+      // +0 and -0 are equal values
+      T value = kernel[i] == T(0.) ? T(0.) : kernel[i];
+      add(&value, sizeof(value));
+    }
+    return h;
+  }
+
+  T tolerance;
+  std::vector<entry> entries;
+  std::unordered_multimap<uint64_t, int> byHash;  // hash -> entry
+};
@@ -0,0 +1,77 @@
+#pragma once
+
+#include <ostream>
+#include <string>
+#include <vector>
+
+/// counters collected during the estimation (printed with --verbose)
+struct runStats {
+  // number of iterations used by each try of the phase retrieval,
+  // one entry per outer iteration
+  std::vector<std::vector<int>> phaseRetrievalIterations;
+  // Fourier transforms done by these iterations, and score of the selected
+  // kernel (to compare the phase retrieval algorithms)
+  std::vector<long> phaseRetrievalTransforms;
+  std::vector<double> kernelScores;
+
+  // kernel size chosen by the automatic mode (0 if it was given)
+  int selectedKernelSize = 0;
+
+  // why the estimation or the final deconvolution were skipped (triage)
+  std::string triage;
+
+  // outer iterations skipped because the support converged
+  int skippedOuterIterations = 0;
+
+  // evaluations skipped because the candidate was identical (or near, see
+  // scoreCache) to an evaluated one
+  long cachedEvaluations = 0;
+
+  // multi-fidelity kernel evaluation
+  long surrogateEvaluations = 0;
+  long fullEvaluations = 0;
+  int surrogateRankings = 0;
+  // number of rankings where the surrogate's best was not the best
+  int surrogateBestMismatches = 0;
+  // pairs of refined candidates ordered differently by the two scores
+  long surrogateComparedPairs = 0;
+  long surrogateDiscordantPairs = 0;
+
+  void print(std::ostream& os) const {
+    if (selectedKernelSize > 0) {
+      os << "kernel size: " << selectedKernelSize << std::endl;
+    }
+    for (unsigned i = 0; i < phaseRetrievalIterations.size(); i++) {
+      const std::vector<int>& iterations = phaseRetrievalIterations[i];
+      long total = 0;
+      for (int n : iterations) total += n;
+      os << "outer iteration " << i << ": phase retrieval iterations";
+      for (int n : iterations) os << " " << n;
+      os << " (total " << total;
+      if (i < phaseRetrievalTransforms.size())
+        os << ", " << phaseRetrievalTransforms[i] << " FFTs";
+      os << ")";
+      if (i < kernelScores.size()) os << ", kernel score " << kernelScores[i];
+      os << std::endl;
+    }
+    if (!triage.empty()) {
+      os << "triage: " << triage << std::endl;
+    }
+    if (skippedOuterIterations > 0) {
+      os << "support converged: " << skippedOuterIterations
+         << " outer iterations skipped" << std::endl;
+    }
+    if (cachedEvaluations > 0) {
+      os << "kernel evaluation: " << cachedEvaluations
+         << " candidates identical or near to another one were not evaluated"
+         << std::endl;
+    }
+    if (surrogateRankings > 0) {
+      os << "kernel evaluation: " << surrogateEvaluations << " surrogate, "
+         << fullEvaluations << " full; the surrogate's best was not the best "
+         << "in " << surrogateBestMismatches << "/" << surrogateRankings
+         << " rankings, discordant pairs " << surrogateDiscordantPairs << "/"
+         << surrogateComparedPairs << std::endl;
+    }
+  }
+};
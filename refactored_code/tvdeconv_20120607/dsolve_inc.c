@@ -12,99 +12,314 @@
  * not, see <http://www.opensource.org/licenses/bsd-license.html>.
  */
 
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
 #include "tvreg.h"
 #include "tvregopt.h"
 
-void DSolve(tvregsolver *S) {
-  numvec2 *d = S->d;
-  numvec2 *dtilde = S->dtilde;
-  const num *u = S->u;
-  const int Width = S->Width;
-  const int Height = S->Height;
-  const int NumChannels = S->NumChannels;
+/**
+ * @brief Vectorial shrinkage of d and update of dtilde on a row segment
+ * @param S tvreg solver state
+ * @param i0 index of the first pixel of the segment (first channel)
+ * @param Count number of pixels of the segment
+ * @param Right offset of the right neighbors in u, 0 if d.x is zero
+ * @param Down offset of the bottom neighbors in u, 0 if d.y is zero
+ *
+ * The magnitudes across the channels are accumulated in S->Shrinkage (at the
+ * pixels of the segment, so that the threads working on different rows do not
+ * share it), and each pass over the channels is a contiguous loop over the
+ * segment.
+ */
+static void ShrinkSegment(tvregsolver *S, long i0, int Count, long Right,
+                          long Down) {
+  const long ChannelStride = ((long)S->Width) * ((long)S->Height);
+  const long NumEl = S->NumChannels * ChannelStride;
   const num Thresh = 1 / S->Opt.Gamma1;
   const num ThreshSquared = Thresh * Thresh;
-  const long ChannelStride = ((long)Width) * ((long)Height);
-  const long NumEl = NumChannels * ChannelStride;
-  numvec2 dnew;
-  num Magnitude;
-  long i;
-  int x, y;
-
-  for (y = 0; y < Height - 1; y++, d++, dtilde++, u++) {
-    /* Perform vectorial shrinkage for interior points */
-    for (x = 0; x < Width - 1; x++, d++, dtilde++, u++) {
-      for (i = 0, Magnitude = 0; i < NumEl; i += ChannelStride) {
-        d[i].x += (u[i + 1] - u[i]) - dtilde[i].x;
-        d[i].y += (u[i + Width] - u[i]) - dtilde[i].y;
-        Magnitude += d[i].x * d[i].x + d[i].y * d[i].y;
-      }
-
-      if (Magnitude > ThreshSquared) {
-        Magnitude = 1 - Thresh / (num)sqrt(Magnitude);
-
-        for (i = 0; i < NumEl; i += ChannelStride) {
-          dnew.x = Magnitude * d[i].x;
-          dnew.y = Magnitude * d[i].y;
-          dtilde[i].x = 2 * dnew.x - d[i].x;
-          dtilde[i].y = 2 * dnew.y - d[i].y;
-          d[i] = dnew;
-        }
-      } else
-        for (i = 0; i < NumEl; i += ChannelStride) {
-          dtilde[i].x = -d[i].x;
-          dtilde[i].y = -d[i].y;
-          d[i].x = 0;
-          d[i].y = 0;
-        }
-    }
+  num *restrict Shrinkage = S->Shrinkage + i0;
+  int x, k;
 
-    /* Right edge */
-    for (i = 0, Magnitude = 0; i < NumEl; i += ChannelStride) {
-      d[i].y += (u[i + Width] - u[i]) - dtilde[i].y;
-      Magnitude += d[i].y * d[i].y;
-      d[i].x = dtilde[i].x = 0;
-    }
+  for (x = 0; x < Count; x++) Shrinkage[x] = 0;
 
-    if (Magnitude > ThreshSquared) {
-      Magnitude = 1 - Thresh / (num)sqrt(Magnitude);
+  for (k = 0; k < S->NumChannels; k++) {
+    const long c = i0 + k * ChannelStride;
+    const num *restrict u = S->u + c;
+    num *restrict dx = S->d + c;
+    num *restrict dy = S->d + NumEl + c;
+    num *restrict dtx = S->dtilde + c;
+    num *restrict dty = S->dtilde + NumEl + c;
 
-      for (i = 0; i < NumEl; i += ChannelStride) {
-        dnew.y = Magnitude * d[i].y;
-        dtilde[i].y = 2 * dnew.y - d[i].y;
-        d[i].y = dnew.y;
+    if (Right && Down) {
+#ifdef _OPENMP
+#pragma omp simd
+#endif
+      for (x = 0; x < Count; x++) {
+        dx[x] += (u[x + Right] - u[x]) - dtx[x];
+        dy[x] += (u[x + Down] - u[x]) - dty[x];
+        Shrinkage[x] += dx[x] * dx[x] + dy[x] * dy[x];
       }
-    } else
-      for (i = 0; i < NumEl; i += ChannelStride) {
-        dtilde[i].y = -d[i].y;
-        d[i].y = 0;
+    } else if (Down) {
+#ifdef _OPENMP
+#pragma omp simd
+#endif
+      for (x = 0; x < Count; x++) {
+        dy[x] += (u[x + Down] - u[x]) - dty[x];
+        Shrinkage[x] += dy[x] * dy[x];
+        dx[x] = dtx[x] = 0;
+      }
+    } else if (Right) {
+#ifdef _OPENMP
+#pragma omp simd
+#endif
+      for (x = 0; x < Count; x++) {
+        dx[x] += (u[x + Right] - u[x]) - dtx[x];
+        Shrinkage[x] += dx[x] * dx[x];
+        dy[x] = dty[x] = 0;
       }
+    } else
+      for (x = 0; x < Count; x++) dx[x] = dy[x] = dtx[x] = dty[x] = 0;
   }
 
-  /* Bottom edge */
-  for (x = 0; x < Width - 1; x++, d++, dtilde++, u++) {
-    for (i = 0, Magnitude = 0; i < NumEl; i += ChannelStride) {
-      d[i].x += (u[i + 1] - u[i]) - dtilde[i].x;
-      Magnitude += d[i].x * d[i].x;
-      d[i].y = dtilde[i].y = 0;
+  /* Shrinkage factor (0 below the threshold: d = 0 and dtilde = -d) */
+#ifdef _OPENMP
+#pragma omp simd
+#endif
+  for (x = 0; x < Count; x++)
+    Shrinkage[x] = (Shrinkage[x] > ThreshSquared)
+                       ? 1 - Thresh / (num)sqrt(Shrinkage[x])
+                       : 0;
+
+  for (k = 0; k < S->NumChannels; k++) {
+    const long c = i0 + k * ChannelStride;
+    num *restrict dx = S->d + c;
+    num *restrict dy = S->d + NumEl + c;
+    num *restrict dtx = S->dtilde + c;
+    num *restrict dty = S->dtilde + NumEl + c;
+
+#ifdef _OPENMP
+#pragma omp simd
+#endif
+    for (x = 0; x < Count; x++) {
+      num dnewx = Shrinkage[x] * dx[x];
+      num dnewy = Shrinkage[x] * dy[x];
+      dtx[x] = 2 * dnewx - dx[x];
+      dty[x] = 2 * dnewy - dy[x];
+      dx[x] = dnewx;
+      dy[x] = dnewy;
     }
+  }
+}
 
-    if (Magnitude > ThreshSquared) {
-      Magnitude = 1 - Thresh / (num)sqrt(Magnitude);
+/**
+ * @brief Divergence of dtilde on one row, as in the original Divergence()
+ * @param DivV destination row
+ * @param Vx, Vy row of dtilde (x and y components)
+ * @param Vyup previous row of the y component, NULL on the first row
+ * @param Width width of the rows
+ * @param Last whether this is the last row
+ *
+ * The discrete divergence is the negative adjoint of the gradient of DSolve(),
+ * the backward differences reduce to one-sided ones at the boundaries.
+ */
+static void DivergenceRow(num *restrict DivV, const num *restrict Vx,
+                          const num *restrict Vy, const num *restrict Vyup,
+                          int Width, int Last) {
+  int x;
 
-      for (i = 0; i < NumEl; i += ChannelStride) {
-        dnew.x = Magnitude * d[i].x;
-        dtilde[i].x = 2 * dnew.x - d[i].x;
-        d[i].x = dnew.x;
-      }
-    } else
-      for (i = 0; i < NumEl; i += ChannelStride) {
-        dtilde[i].x = -d[i].x;
-        d[i].x = 0;
-      }
+  if (Last) {
+    DivV[0] = Vx[0];
+#ifdef _OPENMP
+#pragma omp simd
+#endif
+    for (x = 1; x < Width - 1; x++) DivV[x] = Vx[x] - Vx[x - 1];
+    DivV[Width - 1] = 0;
+  } else if (!Vyup) {
+    DivV[0] = Vx[0] + Vy[0];
+#ifdef _OPENMP
+#pragma omp simd
+#endif
+    for (x = 1; x < Width - 1; x++) DivV[x] = Vx[x] - Vx[x - 1] + Vy[x];
+    DivV[Width - 1] = Vy[Width - 1];
+  } else {
+    DivV[0] = Vx[0] + Vy[0] - Vyup[0];
+#ifdef _OPENMP
+#pragma omp simd
+#endif
+    for (x = 1; x < Width - 1; x++)
+      DivV[x] = Vx[x] - Vx[x - 1] + Vy[x] - Vyup[x];
+    DivV[Width - 1] = Vy[Width - 1] - Vyup[Width - 1];
   }
+}
+
+/**
+ * @brief Divergence of dtilde on one row with periodic boundaries
+ * @param DivV destination row
+ * @param Vx, Vy row of dtilde (x and y components)
+ * @param Vyup previous row of the y component (wrapping around)
+ * @param Width width of the rows
+ */
+static void DivergenceRowPeriodic(num *restrict DivV, const num *restrict Vx,
+                                  const num *restrict Vy,
+                                  const num *restrict Vyup, int Width) {
+  int x;
+
+  DivV[0] = Vx[0] - Vx[Width - 1] + Vy[0] - Vyup[0];
+#ifdef _OPENMP
+#pragma omp simd
+#endif
+  for (x = 1; x < Width; x++) DivV[x] = Vx[x] - Vx[x - 1] + Vy[x] - Vyup[x];
+}
+
+/**
+ * @brief Pad a row of B with even half-sample symmetry
+ * @param B first row of the channel of B, of size 2*Width by 2*Height
+ * @param y index of the row
+ *
+ * Row y is reflected horizontally and copied to row 2*Height-1-y, which is
+ * the symmetric padding of the DFT solver, done row by row.
+ */
+static void SymmetricPaddingRow(num *B, int y, int Width, int Height) {
+  const long PadWidth = 2 * Width;
+  num *Row = B + PadWidth * y;
+  int x;
+
+  for (x = 0; x < Width; x++) Row[Width + x] = Row[Width - 1 - x];
 
-  /* Bottom-right corner */
-  for (i = 0; i < NumEl; i += ChannelStride)
-    d[i].x = d[i].y = dtilde[i].x = dtilde[i].y = 0;
+  memcpy(B + PadWidth * (2 * Height - 1 - y), Row, sizeof(num) * PadWidth);
+}
+
+/**
+ * @brief Divergence of row y of dtilde, in B (all channels)
+ * @param S tvreg solver state
+ * @param y index of the row
+ *
+ * With the DFT solver, the row is also padded with even half-sample symmetry.
+ */
+static void DivergenceRows(tvregsolver *S, int y) {
+  const int Width = S->Width;
+  const int Height = S->Height;
+  const long ChannelStride = ((long)Width) * ((long)Height);
+  const long NumEl = S->NumChannels * ChannelStride;
+  const long PadChannelStride = ((long)S->PadWidth) * ((long)S->PadHeight);
+  int k;
+
+  for (k = 0; k < S->NumChannels; k++) {
+    const long c = ((long)Width) * y + k * ChannelStride;
+    num *B = S->B + k * PadChannelStride;
+
+    DivergenceRow(B + ((long)S->PadWidth) * y, S->dtilde + c,
+                  S->dtilde + NumEl + c,
+                  (y > 0) ? S->dtilde + NumEl + c - Width : NULL, Width,
+                  y == Height - 1);
+
+    if (S->PadWidth != Width) SymmetricPaddingRow(B, y, Width, Height);
+  }
+}
+
+/**
+ * @brief Divergence of row y of dtilde with periodic boundaries, in B
+ * @param S tvreg solver state
+ * @param y index of the row
+ */
+static void DivergenceRowsPeriodic(tvregsolver *S, int y) {
+  const int Width = S->Width;
+  const long ChannelStride = ((long)Width) * ((long)S->Height);
+  const long NumEl = S->NumChannels * ChannelStride;
+  /* Offset of the row above, wrapping from the top row to the bottom one */
+  const long Up = (y > 0) ? -Width : ChannelStride - Width;
+  int k;
+
+  for (k = 0; k < S->NumChannels; k++) {
+    const long c = ((long)Width) * y + k * ChannelStride;
+
+    DivergenceRowPeriodic(S->B + c, S->dtilde + c, S->dtilde + NumEl + c,
+                          S->dtilde + NumEl + c + Up, Width);
+  }
+}
+
+/**
+ * @brief Rows of the calling thread, a contiguous block of the rows
+ * @param y0, y1 the rows y0, ..., y1 - 1 of the block
+ * @param Height number of rows
+ */
+static void RowBlock(int *y0, int *y1, int Height) {
+  int Block = 0, NumBlocks = 1;
+
+#ifdef _OPENMP
+  Block = omp_get_thread_num();
+  NumBlocks = omp_get_num_threads();
+#endif
+  *y0 = (int)(((long)Height) * Block / NumBlocks);
+  *y1 = (int)(((long)Height) * (Block + 1) / NumBlocks);
+}
+
+/* The rows are split in contiguous blocks, one per thread.  The divergence of
+   the first row of a block needs the previous row (the last one for the
+   first block with periodic boundaries), so it is computed once all the
+   blocks are done.  Every row is computed the same way whatever the number of
+   threads. */
+
+void DSolve(tvregsolver *S) {
+  const int Width = S->Width;
+  const int Height = S->Height;
+
+#ifdef _OPENMP
+#pragma omp parallel num_threads(S->Opt.NumThreads) if (S->Opt.NumThreads > 1)
+#endif
+  {
+    int y0, y1, y;
+
+    RowBlock(&y0, &y1, Height);
+
+    for (y = y0; y < y1; y++) {
+      const long i = ((long)Width) * y;
+      /* No vertical difference on the last row */
+      const long Down = (y < Height - 1) ? Width : 0;
+
+      /* Interior points and right edge (bottom edge and corner on the last
+         row) */
+      ShrinkSegment(S, i, Width - 1, 1, Down);
+      ShrinkSegment(S, i + Width - 1, 1, 0, Down);
+
+      if (y > y0) DivergenceRows(S, y);
+    }
+
+#ifdef _OPENMP
+#pragma omp barrier
+#endif
+    if (y0 < y1) DivergenceRows(S, y0);
+  }
+}
+
+void DSolvePeriodic(tvregsolver *S) {
+  const int Width = S->Width;
+  const int Height = S->Height;
+
+#ifdef _OPENMP
+#pragma omp parallel num_threads(S->Opt.NumThreads) if (S->Opt.NumThreads > 1)
+#endif
+  {
+    int y0, y1, y;
+
+    RowBlock(&y0, &y1, Height);
+
+    for (y = y0; y < y1; y++) {
+      const long i = ((long)Width) * y;
+      /* Offset of the pixel below, wrapping from the bottom row to the top */
+      const long Down = (y < Height - 1) ? Width : -(long)Width * (Height - 1);
+
+      /* Interior points, then right edge wrapping to the left one */
+      ShrinkSegment(S, i, Width - 1, 1, Down);
+      ShrinkSegment(S, i + Width - 1, 1, -(Width - 1), Down);
+
+      if (y > y0) DivergenceRowsPeriodic(S, y);
+    }
+
+#ifdef _OPENMP
+#pragma omp barrier
+#endif
+    if (y0 < y1) DivergenceRowsPeriodic(S, y0);
+  }
 }
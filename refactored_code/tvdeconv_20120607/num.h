@@ -4,7 +4,8 @@
  * @author Pascal Getreuer <getreuer@gmail.com>
  *
  * This file defines type "num", which by default is a typedef for double.
- * If NUM_SINGLE is defined, then num is a typedef for float.
+ * If NUM_SINGLE is defined, then num is a typedef for float, and the external
+ * names of tvreg are prefixed (see tvreg_single.h).
  *
  * Copyright (c) 2010-2012, Pascal Getreuer
  * All rights reserved.
@@ -14,12 +15,17 @@
  * should have received a copy of this license along this program. If
  * not, see <http://www.opensource.org/licenses/bsd-license.html>.
  */
-#pragma once
-
+/* Included once per precision (see tvreg_single.h) */
+#if defined(NUM_SINGLE) ? !defined(_NUM_H_SINGLE) : !defined(_NUM_H)
 #ifdef NUM_SINGLE
+#define _NUM_H_SINGLE
 /* Use single-precision datatype */
 typedef float num;
 #else
+#define _NUM_H
 /* Use double-precision datatype */
 typedef double num;
 #endif
+#endif
+
+#include "tvreg_single.h"
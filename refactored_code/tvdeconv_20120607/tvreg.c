@@ -18,6 +18,11 @@
 
 #include "tvregopt.h"
 
+static int AllocDeconvBuffers(tvregsolver *S, int DctFlag);
+static void LoadBuffers(tvregsolver *S, const tvregbuffers *Buffers);
+static void StoreBuffers(tvregbuffers *Buffers, const tvregsolver *S);
+static num SumOfSquares(const num *f, long NumEl, int NumThreads);
+
 /**
  * @brief Total variation based image restoration
  * @param u initial guess, overwritten with restored image
@@ -61,6 +66,7 @@
  *    - TvRegSetMaxIter():        maximum number of iterations
  *    - TvRegSetGamma1():         constraint weight on d = grad u
  *    - TvRegSetPlotFun():        custom plotting function
+ *    - TvRegSetContext():        buffers and plans reused between calls
  *
  * When done, call TvRegFreeOpt() to free the options object.  Setting
  * Opt = NULL uses the default options (denoising with Gaussian noise model).
@@ -82,6 +88,8 @@ int TvRestore(num *u, const num *f, int Width, int Height, int NumChannels,
   const long NumPixels = ((long)Width) * ((long)Height);
   const long NumEl = NumPixels * NumChannels;
   tvregsolver S;
+  tvregcontext *Context = NULL;
+  tvregbuffers *Buffers = NULL;
   usolver USolveFun = NULL;
   zsolver ZSolveFun = NULL;
   num DiffNorm = NAN;
@@ -116,6 +124,21 @@ int TvRestore(num *u, const num *f, int Width, int Height, int NumChannels,
     return 0;
   }
 
+  /* The periodic mode only changes the DFT solver */
+  S.Periodic = S.Opt.Periodic && DeconvFlag && !DctFlag;
+
+  /* The buffers and plans of a context are used instead of new ones */
+  if (S.Opt.Context && S.Opt.Context->Width == Width &&
+      S.Opt.Context->Height == Height &&
+      S.Opt.Context->NumChannels == NumChannels) {
+    Context = S.Opt.Context;
+    Buffers = (DctFlag)      ? &Context->Dct
+              : (S.Periodic) ? &Context->PeriodicFourier
+                             : &Context->Fourier;
+
+    S.Opt.Shape = Context->Shape;
+  }
+
   S.u = u;
   S.f = f;
   S.Width = S.PadWidth = Width;
@@ -124,13 +147,21 @@ int TvRestore(num *u, const num *f, int Width, int Height, int NumChannels,
   S.Alpha = ((!S.UseZ) ? S.Opt.Lambda : S.Opt.Gamma2) / S.Opt.Gamma1;
 
   /*** Allocate memory ***************************************************/
-  S.d = S.dtilde = NULL;
+  S.d = S.dtilde = S.Shrinkage = NULL;
 
   S.A = S.B = S.ATrans = S.BTrans = S.KernelTrans = S.DenomTrans = NULL;
   S.TransformA = S.TransformB = S.InvTransformA = S.InvTransformB = NULL;
+  S.TransformKernel = NULL;
+
+  if (Context) {
+    if (DeconvFlag) LoadBuffers(&S, Buffers);
 
-  if (!(S.d = (numvec2 *)Malloc(sizeof(numvec2) * NumEl)) ||
-      !(S.dtilde = (numvec2 *)Malloc(sizeof(numvec2) * NumEl)))
+    S.d = Context->d;
+    S.dtilde = Context->dtilde;
+    S.Shrinkage = Context->Shrinkage;
+  } else if (!(S.d = (num *)Malloc(sizeof(num) * 2 * NumEl)) ||
+             !(S.dtilde = (num *)Malloc(sizeof(num) * 2 * NumEl)) ||
+             !(S.Shrinkage = (num *)Malloc(sizeof(num) * NumPixels)))
     goto Catch;
 
   if (S.UseZ)
@@ -148,50 +179,24 @@ int TvRestore(num *u, const num *f, int Width, int Height, int NumChannels,
     goto Catch;
   }
 
+  if (DeconvFlag && !DctFlag && !S.Periodic) {
+    S.PadWidth = 2 * Width;
+    S.PadHeight = 2 * Height;
+  }
+
+  /* With a context, the buffers and plans loaded above are reused (they are
+     created by the first call); the kernel transforms are computed by every
+     call */
   if (!DeconvFlag)
     S.Ku = u;
-  else
-    /* The following applies only for problems with deconvolution */
-    if (DctFlag) { /* Prepare for DCT-based deconvolution */
-      long PadNumPixels = ((long)Width + 1) * ((long)Height + 1);
-
-      if (!(S.ATrans = (num *)FFT(malloc)(sizeof(num) * NumEl)) ||
-          !(S.BTrans = (num *)FFT(malloc)(sizeof(num) * NumEl)) ||
-          !(S.A = (num *)FFT(malloc)(sizeof(num) * NumEl)) ||
-          !(S.B =
-                (num *)FFT(malloc)(sizeof(num) * PadNumPixels * NumChannels)) ||
-          !(S.KernelTrans = (num *)FFT(malloc)(sizeof(num) * PadNumPixels)) ||
-          !(S.DenomTrans = (num *)Malloc(sizeof(num) * NumPixels)) ||
-          !InitDeconvDct(&S))
-        goto Catch;
-    } else { /* Prepare for Fourier-based deconvolution */
-      long NumTransPixels = 0, NumTransEl = 0, PadNumEl = 0;
-      int TransWidth = 0;
-
-      S.PadWidth = 2 * Width;
-      S.PadHeight = 2 * Height;
-      TransWidth = S.PadWidth / 2 + 1;
-      NumTransPixels = ((long)TransWidth) * ((long)S.PadHeight);
-      NumTransEl = NumTransPixels * NumChannels;
-      PadNumEl = (((long)S.PadWidth) * S.PadHeight) * NumChannels;
-
-      if (!(S.ATrans = (num *)FFT(malloc)(sizeof(numcomplex) * NumTransEl)) ||
-          !(S.BTrans = (num *)FFT(malloc)(sizeof(numcomplex) * NumTransEl)) ||
-          !(S.A = (num *)FFT(malloc)(sizeof(num) * PadNumEl)) ||
-          !(S.B = (num *)FFT(malloc)(sizeof(num) * PadNumEl)) ||
-          !(S.KernelTrans =
-                (num *)FFT(malloc)(sizeof(numcomplex) * NumTransPixels)) ||
-          !(S.DenomTrans = (num *)Malloc(sizeof(num) * NumTransPixels)) ||
-          !InitDeconvFourier(&S))
-        goto Catch;
-    }
+  else if (!AllocDeconvBuffers(&S, DctFlag) ||
+           !((DctFlag) ? InitDeconvDct(&S) : InitDeconvFourier(&S)))
+    goto Catch;
 
   /*** Algorithm initializations *****************************************/
 
   /* Set convergence threshold scaled by norm of f */
-  for (i = 0, S.fNorm = 0; i < NumEl; i++) S.fNorm += f[i] * f[i];
-
-  S.fNorm = (num)sqrt(S.fNorm);
+  S.fNorm = (num)sqrt(SumOfSquares(f, NumEl, S.Opt.NumThreads));
 
   if (S.fNorm == 0) /* Special case, input image is zero */
   {
@@ -201,9 +206,9 @@ int TvRestore(num *u, const num *f, int Width, int Height, int NumChannels,
   }
 
   /* Initialize d = dtilde = 0 */
-  for (i = 0; i < NumEl; i++) S.d[i].x = S.d[i].y = 0;
+  for (i = 0; i < 2 * NumEl; i++) S.d[i] = 0;
 
-  for (i = 0; i < NumEl; i++) S.dtilde[i].x = S.dtilde[i].y = 0;
+  for (i = 0; i < 2 * NumEl; i++) S.dtilde[i] = 0;
 
   DiffNorm = (S.Opt.Tol > 0) ? 1000 * S.Opt.Tol : 1000;
   Success = 2;
@@ -214,8 +219,11 @@ int TvRestore(num *u, const num *f, int Width, int Height, int NumChannels,
 
   /*** Algorithm main loop: Bregman iterations ***************************/
   for (Iter = 1; Iter <= S.Opt.MaxIter; Iter++) {
-    /* Solve d subproblem and update dtilde */
-    DSolve(&S);
+    /* Solve d subproblem, update dtilde and compute B = div(dtilde) */
+    if (S.Periodic)
+      DSolvePeriodic(&S);
+    else
+      DSolve(&S);
 
     /* Solve u subproblem */
     DiffNorm = USolveFun(&S);
@@ -235,6 +243,15 @@ int TvRestore(num *u, const num *f, int Width, int Height, int NumChannels,
                   DiffNorm, u, Width, Height, NumChannels, S.Opt.PlotParam);
 Catch:
   /*** Release memory ****************************************************/
+  if (Context) {
+    /* The context keeps the buffers and plans, including the ones created
+       before a failure */
+    if (DeconvFlag) StoreBuffers(Buffers, &S);
+
+    return Success;
+  }
+
+  if (S.Shrinkage) Free(S.Shrinkage);
   if (S.dtilde) Free(S.dtilde);
   if (S.d) Free(S.d);
 
@@ -250,6 +267,7 @@ Catch:
 #pragma omp critical(fftw)
 #endif
     {
+      if (S.TransformKernel) FFT(destroy_plan)(S.TransformKernel);
       FFT(destroy_plan)(S.InvTransformB);
       FFT(destroy_plan)(S.TransformB);
       FFT(destroy_plan)(S.InvTransformA);
@@ -260,6 +278,218 @@ Catch:
   return Success;
 }
 
+/**
+ * @brief Allocate the buffers of the deconvolution solver
+ * @param S tvreg solver state, whose buffers that are not NULL are kept
+ * @param DctFlag whether the DCT solver is used (DFT solver otherwise)
+ * @return 1 on success, 0 on failure
+ */
+static int AllocDeconvBuffers(tvregsolver *S, int DctFlag) {
+  const long NumPixels = ((long)S->Width) * ((long)S->Height);
+  const long NumEl = NumPixels * S->NumChannels;
+
+  if (DctFlag) {
+    long PadNumPixels = ((long)S->Width + 1) * ((long)S->Height + 1);
+
+    return (S->ATrans ||
+            (S->ATrans = (num *)FFT(malloc)(sizeof(num) * NumEl))) &&
+           (S->BTrans ||
+            (S->BTrans = (num *)FFT(malloc)(sizeof(num) * NumEl))) &&
+           (S->A || (S->A = (num *)FFT(malloc)(sizeof(num) * NumEl))) &&
+           (S->B || (S->B = (num *)FFT(malloc)(sizeof(num) * PadNumPixels *
+                                               S->NumChannels))) &&
+           (S->KernelTrans ||
+            (S->KernelTrans = (num *)FFT(malloc)(sizeof(num) * PadNumPixels))) &&
+           (S->DenomTrans ||
+            (S->DenomTrans = (num *)Malloc(sizeof(num) * NumPixels)));
+  } else {
+    const int TransWidth = S->PadWidth / 2 + 1;
+    const long NumTransPixels = ((long)TransWidth) * ((long)S->PadHeight);
+    const long NumTransEl = NumTransPixels * S->NumChannels;
+    const long PadNumEl =
+        (((long)S->PadWidth) * S->PadHeight) * S->NumChannels;
+
+    return (S->ATrans || (S->ATrans = (num *)FFT(malloc)(sizeof(numcomplex) *
+                                                         NumTransEl))) &&
+           (S->BTrans || (S->BTrans = (num *)FFT(malloc)(sizeof(numcomplex) *
+                                                         NumTransEl))) &&
+           (S->A || (S->A = (num *)FFT(malloc)(sizeof(num) * PadNumEl))) &&
+           (S->B || (S->B = (num *)FFT(malloc)(sizeof(num) * PadNumEl))) &&
+           (S->KernelTrans ||
+            (S->KernelTrans = (num *)FFT(malloc)(sizeof(numcomplex) *
+                                                 NumTransPixels))) &&
+           (S->DenomTrans ||
+            (S->DenomTrans = (num *)Malloc(sizeof(num) * NumTransPixels)));
+  }
+}
+
+/** @brief Sum of the squares of f, by blocks (see REDUCTION_BLOCKS) */
+static num SumOfSquares(const num *f, long NumEl, int NumThreads) {
+  num Partial[REDUCTION_BLOCKS];
+  num Sum = 0;
+  int b;
+
+#ifdef _OPENMP
+#pragma omp parallel for num_threads(NumThreads) if (NumThreads > 1)
+#endif
+  for (b = 0; b < REDUCTION_BLOCKS; b++) {
+    const long End = NumEl * (b + 1) / REDUCTION_BLOCKS;
+    num BlockSum = 0;
+    long i;
+
+    for (i = NumEl * b / REDUCTION_BLOCKS; i < End; i++)
+      BlockSum += f[i] * f[i];
+
+    Partial[b] = BlockSum;
+  }
+
+  for (b = 0; b < REDUCTION_BLOCKS; b++) Sum += Partial[b];
+
+  return Sum;
+}
+
+/** @brief Use the buffers and plans of a context in the solver state */
+static void LoadBuffers(tvregsolver *S, const tvregbuffers *Buffers) {
+  S->A = Buffers->A;
+  S->B = Buffers->B;
+  S->ATrans = Buffers->ATrans;
+  S->BTrans = Buffers->BTrans;
+  S->DenomTrans = Buffers->DenomTrans;
+  S->KernelTrans = Buffers->KernelTrans;
+  S->TransformA = Buffers->TransformA;
+  S->TransformB = Buffers->TransformB;
+  S->InvTransformA = Buffers->InvTransformA;
+  S->InvTransformB = Buffers->InvTransformB;
+  S->TransformKernel = Buffers->TransformKernel;
+}
+
+/** @brief Keep the buffers and plans of the solver state in a context */
+static void StoreBuffers(tvregbuffers *Buffers, const tvregsolver *S) {
+  Buffers->A = S->A;
+  Buffers->B = S->B;
+  Buffers->ATrans = S->ATrans;
+  Buffers->BTrans = S->BTrans;
+  Buffers->DenomTrans = S->DenomTrans;
+  Buffers->KernelTrans = S->KernelTrans;
+  Buffers->TransformA = S->TransformA;
+  Buffers->TransformB = S->TransformB;
+  Buffers->InvTransformA = S->InvTransformA;
+  Buffers->InvTransformB = S->InvTransformB;
+  Buffers->TransformKernel = S->TransformKernel;
+}
+
+/** @brief Free the buffers and plans kept by a context */
+static void FreeBuffers(tvregbuffers *Buffers) {
+  if (Buffers->DenomTrans) Free(Buffers->DenomTrans);
+  if (Buffers->KernelTrans) FFT(free)(Buffers->KernelTrans);
+  if (Buffers->B) FFT(free)(Buffers->B);
+  if (Buffers->A) FFT(free)(Buffers->A);
+  if (Buffers->BTrans) FFT(free)(Buffers->BTrans);
+  if (Buffers->ATrans) FFT(free)(Buffers->ATrans);
+
+#ifdef _OPENMP
+#pragma omp critical(fftw)
+#endif
+  {
+    if (Buffers->TransformKernel) FFT(destroy_plan)(Buffers->TransformKernel);
+    if (Buffers->InvTransformB) FFT(destroy_plan)(Buffers->InvTransformB);
+    if (Buffers->TransformB) FFT(destroy_plan)(Buffers->TransformB);
+    if (Buffers->InvTransformA) FFT(destroy_plan)(Buffers->InvTransformA);
+    if (Buffers->TransformA) FFT(destroy_plan)(Buffers->TransformA);
+  }
+}
+
+tvregcontext *TvRegNewContext(int Width, int Height, int NumChannels) {
+  const long NumEl = ((long)Width) * ((long)Height) * NumChannels;
+  tvregcontext *Context;
+
+  if (Width < 2 || Height < 2 || NumChannels <= 0 ||
+      !(Context = (tvregcontext *)Malloc(sizeof(tvregcontext))))
+    return NULL;
+
+  memset(Context, 0, sizeof(tvregcontext));
+  Context->Width = Width;
+  Context->Height = Height;
+  Context->NumChannels = NumChannels;
+
+  if (!(Context->Shape = TvRegNewShape(Width, Height)) ||
+      !(Context->d = (num *)Malloc(sizeof(num) * 2 * NumEl)) ||
+      !(Context->dtilde = (num *)Malloc(sizeof(num) * 2 * NumEl)) ||
+      !(Context->Shrinkage =
+            (num *)Malloc(sizeof(num) * ((long)Width) * Height))) {
+    TvRegFreeContext(Context);
+    return NULL;
+  }
+
+  return Context;
+}
+
+void TvRegFreeContext(tvregcontext *Context) {
+  if (Context) {
+    FreeBuffers(&Context->PeriodicFourier);
+    FreeBuffers(&Context->Fourier);
+    FreeBuffers(&Context->Dct);
+    if (Context->Shrinkage) Free(Context->Shrinkage);
+    if (Context->dtilde) Free(Context->dtilde);
+    if (Context->d) Free(Context->d);
+    TvRegFreeShape(Context->Shape);
+    Free(Context);
+  }
+}
+
+tvregshape *TvRegNewShape(int Width, int Height) {
+  const int PadWidth = 2 * Width;
+  const int PadHeight = 2 * Height;
+  const int TransWidth = PadWidth / 2 + 1;
+  tvregshape *Shape;
+  long i;
+  int x, y;
+
+  if (Width < 2 || Height < 2 ||
+      !(Shape = (tvregshape *)Malloc(sizeof(tvregshape))))
+    return NULL;
+
+  Shape->Width = Width;
+  Shape->Height = Height;
+  Shape->FourierLaplacian = Shape->PeriodicLaplacian = NULL;
+
+  if (!(Shape->DctLaplacian =
+            (num *)Malloc(sizeof(num) * ((long)Width) * Height)) ||
+      !(Shape->FourierLaplacian =
+            (num *)Malloc(sizeof(num) * ((long)TransWidth) * PadHeight)) ||
+      !(Shape->PeriodicLaplacian =
+            (num *)Malloc(sizeof(num) * ((long)(Width / 2 + 1)) * Height))) {
+    TvRegFreeShape(Shape);
+    return NULL;
+  }
+
+  for (y = 0, i = 0; y < Height; y++)
+    for (x = 0; x < Width; x++, i++)
+      Shape->DctLaplacian[i] =
+          2 * (2 - cos(x * M_PI / Width) - cos(y * M_PI / Height));
+
+  for (y = 0, i = 0; y < PadHeight; y++)
+    for (x = 0; x < TransWidth; x++, i++)
+      Shape->FourierLaplacian[i] =
+          2 * (2 - cos(x * M_2PI / PadWidth) - cos(y * M_2PI / PadHeight));
+
+  for (y = 0, i = 0; y < Height; y++)
+    for (x = 0; x < Width / 2 + 1; x++, i++)
+      Shape->PeriodicLaplacian[i] =
+          2 * (2 - cos(x * M_2PI / Width) - cos(y * M_2PI / Height));
+
+  return Shape;
+}
+
+void TvRegFreeShape(tvregshape *Shape) {
+  if (Shape) {
+    if (Shape->PeriodicLaplacian) Free(Shape->PeriodicLaplacian);
+    if (Shape->FourierLaplacian) Free(Shape->FourierLaplacian);
+    if (Shape->DctLaplacian) Free(Shape->DctLaplacian);
+    Free(Shape);
+  }
+}
+
 /** @brief Test if Kernel is whole-sample symmetric */
 static int IsSymmetric(const num *Kernel, int KernelWidth, int KernelHeight) {
   int x = 0, xr = 0, y = 0, yr = 0;
@@ -11,7 +11,13 @@
  * should have received a copy of this license along this program. If
  * not, see <http://www.opensource.org/licenses/bsd-license.html>.
  */
-#pragma once
+/* Included once per precision (see tvreg_single.h) */
+#if defined(NUM_SINGLE) ? !defined(_TVREG_H_SINGLE) : !defined(_TVREG_H)
+#ifdef NUM_SINGLE
+#define _TVREG_H_SINGLE
+#else
+#define _TVREG_H
+#endif
 
 #include "basic.h"
 #include "num.h"
@@ -27,15 +33,54 @@
 /** @brief Default maximum number of Bregman iterations */
 #define TVREGOPT_DEFAULT_MAXITER 100
 
-/* tvregopt is encapsulated by forward declaration */
+/* tvregopt is encapsulated by forward declaration (the tags are declared on
+   their own first, so that C++ declares them in the namespace of the
+   single-precision instance, see tvreg_single.h) */
+struct tag_tvregopt;
+struct tag_tvregsolver;
+struct tag_tvregshape;
+struct tag_tvregcontext;
 typedef struct tag_tvregopt tvregopt;
 typedef struct tag_tvregsolver tvregsolver;
+typedef struct tag_tvregshape tvregshape;
+typedef struct tag_tvregcontext tvregcontext;
 typedef num (*usolver)(tvregsolver *);
 typedef void (*zsolver)(tvregsolver *);
 
 int TvRestore(num *u, const num *f, int Width, int Height, int NumChannels,
               tvregopt *Opt);
 
+/**
+ * @brief Create the kernel-independent precomputations for an image size
+ * @param Width, Height dimensions of the images that will be restored
+ * @return tvregshape pointer, or NULL if out of memory
+ *
+ * The object holds the transforms of the laplacian used in the denominator
+ * of the u-subproblem, for both the DCT and the DFT solvers.  It is held by
+ * a tvregcontext (see TvRegNewContext()), so that the TvRestore calls using
+ * the context do not recompute it for each kernel.  Call TvRegFreeShape() to
+ * free it when done.
+ */
+tvregshape *TvRegNewShape(int Width, int Height);
+
+/** @brief Free tvregshape object */
+void TvRegFreeShape(tvregshape *Shape);
+
+/**
+ * @brief Create the state reused by the restorations of images of one size
+ * @param Width, Height, NumChannels dimensions of the images
+ * @return tvregcontext pointer, or NULL if out of memory
+ *
+ * The object holds the solver buffers and the FFTW plans, created by the first
+ * TvRestore call using it through TvRegSetContext().  Only f, the kernel and
+ * lambda change between the calls.  It can
+ * only be used by one call at a time.  Call TvRegFreeContext() to free it.
+ */
+tvregcontext *TvRegNewContext(int Width, int Height, int NumChannels);
+
+/** @brief Free tvregcontext object */
+void TvRegFreeContext(tvregcontext *Context);
+
 /** @brief Algorithm planning function */
 int TvRestoreChooseAlgorithm(int *UseZ, int *DeconvFlag, int *DctFlag,
                              usolver *USolveFun, zsolver *ZSolveFun,
@@ -61,17 +106,34 @@ int TvRestoreChooseAlgorithm(int *UseZ, int *DeconvFlag, int *DctFlag,
  * Rather than representing b directly, we use  \f$ \tilde d = d - b \f$,
  * which is algebraically equivalent but requires less arithmetic.
  *
- * To represent the vector field d, we implement d as a numvec2 array of
- * size Width x Height x NumChannels such that
+ * As each row of \f$ \tilde d \f$ is done, the routine computes the same
+ * row of its divergence in S->B (with the symmetric padding of the DFT
+ * solver), the first step of the u-subproblem, so that \f$ \tilde d \f$ is
+ * only read once per iteration.
+ *
+ * To represent the vector field d, we implement d as a num array of size
+ * 2 x Width x Height x NumChannels (the x-components, then the y-components)
+ * such that, with NumEl = Width*Height*NumChannels,
 @code
-    d[i + Width*(j + Height*k)].x = x-component at pixel (i,j) channel k,
-    d[i + Width*(j + Height*k)].y = y-component at pixel (i,j) channel k,
+    d[i + Width*(j + Height*k)]         = x-component at pixel (i,j) channel k,
+    d[i + Width*(j + Height*k) + NumEl] = y-component at pixel (i,j) channel k,
 @endcode
  * where i = 0, ..., Width-1, j = 0, ..., Height-1, and k = 0, ...,
  * NumChannels-1.  This structure is also used for \f$ \tilde d \f$.
  */
 void DSolve(tvregsolver *S);
 
+/**
+ * @brief Solve the d subproblem with periodic boundaries
+ * @param S tvreg solver state
+ *
+ * Same as DSolve(), but the forward differences at the right and bottom
+ * boundaries wrap around to the left and top of the image, instead of being
+ * set to zero.  It is used by the periodic mode of the DFT solver (see
+ * TvRegSetPeriodic()).
+ */
+void DSolvePeriodic(tvregsolver *S);
+
 /**
  * @brief Intializations to prepare TvRestore for DCT-based deconvolution
  * @param S tvreg solver state
@@ -127,4 +189,6 @@ num UDeconvFourier(tvregsolver *S);
  * @param S tvreg solver state
  * @return 1 on success, 0 on failure
  */
-int InitDeconvFourier(tvregsolver *S);
\ No newline at end of file
+int InitDeconvFourier(tvregsolver *S);
+
+#endif
@@ -0,0 +1,73 @@
+/**
+ * @file tvreg_single.h
+ * @brief External names of the single-precision instance of tvreg
+ *
+ * tvreg is compiled twice: as is (num = double), and with NUM_SINGLE defined
+ * (num = float).  So that both instances can be linked in the same program,
+ * the functions of the single-precision instance are prefixed with "Single",
+ * like the fftwf_ functions of FFTW.  This header is included by num.h: with
+ * NUM_SINGLE defined, it defines the prefixed names; without it, it removes
+ * them.
+ *
+ * C++ code can declare both instances by including tvreg.h and tvregopt.h,
+ * then including them again in a namespace with NUM_SINGLE defined (the
+ * headers are included once per precision), and finally including this
+ * header again without NUM_SINGLE, so that the names that follow refer to the
+ * double-precision instance (see deconvBregman.hpp).
+ */
+
+/* No include guard: each inclusion defines or removes the names */
+
+#ifdef NUM_SINGLE
+#define TvRestore SingleTvRestore
+#define TvRegNewShape SingleTvRegNewShape
+#define TvRegFreeShape SingleTvRegFreeShape
+#define TvRegNewContext SingleTvRegNewContext
+#define TvRegFreeContext SingleTvRegFreeContext
+#define TvRestoreChooseAlgorithm SingleTvRestoreChooseAlgorithm
+#define DSolve SingleDSolve
+#define DSolvePeriodic SingleDSolvePeriodic
+#define InitDeconvDct SingleInitDeconvDct
+#define UDeconvDct SingleUDeconvDct
+#define InitDeconvFourier SingleInitDeconvFourier
+#define UDeconvFourier SingleUDeconvFourier
+#define TvRegDefaultOpt SingleTvRegDefaultOpt
+#define TvRegNewOpt SingleTvRegNewOpt
+#define TvRegFreeOpt SingleTvRegFreeOpt
+#define TvRegSetLambda SingleTvRegSetLambda
+#define TvRegSetKernel SingleTvRegSetKernel
+#define TvRegSetTol SingleTvRegSetTol
+#define TvRegSetGamma1 SingleTvRegSetGamma1
+#define TvRegSetMaxIter SingleTvRegSetMaxIter
+#define TvRegSetContext SingleTvRegSetContext
+#define TvRegSetPeriodic SingleTvRegSetPeriodic
+#define TvRegSetNumThreads SingleTvRegSetNumThreads
+#define TvRegSetPlotFun SingleTvRegSetPlotFun
+#define TvRestoreSimplePlot SingleTvRestoreSimplePlot
+#else
+#undef TvRestore
+#undef TvRegNewShape
+#undef TvRegFreeShape
+#undef TvRegNewContext
+#undef TvRegFreeContext
+#undef TvRestoreChooseAlgorithm
+#undef DSolve
+#undef DSolvePeriodic
+#undef InitDeconvDct
+#undef UDeconvDct
+#undef InitDeconvFourier
+#undef UDeconvFourier
+#undef TvRegDefaultOpt
+#undef TvRegNewOpt
+#undef TvRegFreeOpt
+#undef TvRegSetLambda
+#undef TvRegSetKernel
+#undef TvRegSetTol
+#undef TvRegSetGamma1
+#undef TvRegSetMaxIter
+#undef TvRegSetContext
+#undef TvRegSetPeriodic
+#undef TvRegSetNumThreads
+#undef TvRegSetPlotFun
+#undef TvRestoreSimplePlot
+#endif
@@ -11,7 +11,13 @@
  * should have received a copy of this license along this program. If
  * not, see <http://www.opensource.org/licenses/bsd-license.html>.
  */
-#pragma once
+/* Included once per precision (see tvreg_single.h) */
+#if defined(NUM_SINGLE) ? !defined(_TVREGOPT_H_SINGLE) : !defined(_TVREGOPT_H)
+#ifdef NUM_SINGLE
+#define _TVREGOPT_H_SINGLE
+#else
+#define _TVREGOPT_H
+#endif
 
 #include <fftw3.h>
 #include <string.h>
@@ -21,6 +27,14 @@
 /** @brief Size of the string buffer for holding the algorithm description */
 #define ALGSTRING_SIZE 128
 
+/**
+ * @brief Number of blocks of the parallel sums (norms of f and of the updates)
+ *
+ * The partial sums of the blocks are added in order, so that the sums do not
+ * depend on the number of threads.
+ */
+#define REDUCTION_BLOCKS 64
+
 /**
  * @brief  Token concatenation macro
  *
@@ -35,6 +49,8 @@
  */
 #define _TVREG_CONCAT(A, B) A##B
 
+/* Defined by the other precision if both are declared */
+#undef FFT
 #ifdef NUM_SINGLE
 #define FFT(S) _TVREG_CONCAT(fftwf_, S)
 #else
@@ -72,6 +88,46 @@ struct tag_tvregopt {
   int (*PlotFun)(int, int, num, const num *, int, int, int, void *);
   void *PlotParam;
   char *AlgString;
+  const tvregshape *Shape;
+  int NumThreads;
+  tvregcontext *Context;
+  int Periodic;
+};
+
+/** @brief Kernel-independent precomputations for a given image size */
+struct tag_tvregshape {
+  int Width;              /**< Image width                        */
+  int Height;             /**< Image height                       */
+  num *DctLaplacian;      /**< Laplacian term of DCT DenomTrans   */
+  num *FourierLaplacian;  /**< Laplacian term of DFT DenomTrans   */
+  num *PeriodicLaplacian; /**< Same, with periodic boundaries     */
+};
+
+/** @brief Buffers and plans of one u-subproblem solver, kept by a context */
+typedef struct tag_tvregbuffers {
+  num *A, *B;                /**< Spatial FFTW buffers               */
+  num *ATrans, *BTrans;      /**< Spectral FFTW buffers              */
+  num *DenomTrans;           /**< Precomputation for u subproblem    */
+  num *KernelTrans;          /**< Convolution kernel transform       */
+  FFT(plan) TransformA;      /**< Forward transform plan A -> ATrans */
+  FFT(plan) TransformB;      /**< Forward transform plan B -> BTrans */
+  FFT(plan) InvTransformA;   /**< Inverse transform plan ATrans -> A */
+  FFT(plan) InvTransformB;   /**< Inverse transform plan BTrans -> B */
+  FFT(plan) TransformKernel; /**< Kernel transform plan B -> KernelTrans */
+} tvregbuffers;
+
+/** @brief State reused by the TvRestore calls on images of one size */
+struct tag_tvregcontext {
+  int Width;              /**< Image width                        */
+  int Height;             /**< Image height                       */
+  int NumChannels;        /**< Number of image channels           */
+  tvregshape *Shape;      /**< Kernel-independent precomputations */
+  num *d;                 /**< Buffer of d                        */
+  num *dtilde;            /**< Buffer of dtilde                   */
+  num *Shrinkage;         /**< Buffer of DSolve()                 */
+  tvregbuffers Dct;       /**< DCT solver (symmetric kernels)     */
+  tvregbuffers Fourier;   /**< DFT solver (other kernels)         */
+  tvregbuffers PeriodicFourier; /**< DFT solver, periodic boundaries */
 };
 
 /**
@@ -83,8 +139,9 @@ struct tag_tvregopt {
 typedef struct tag_tvregsolver {
   num *u;          /**< Current restoration solution       */
   const num *f;    /**< Input image                        */
-  numvec2 *d;      /**< Current solution of d              */
-  numvec2 *dtilde; /**< Bregman variable for d constraint  */
+  num *d;          /**< Current solution of d (x, then y)  */
+  num *dtilde;     /**< Bregman variable for d constraint  */
+  num *Shrinkage;  /**< Buffer of DSolve()                 */
   num *Ku;         /**< Convolution of kernel with u       */
 
   num fNorm;               /**< L2 norm of f                       */
@@ -96,6 +153,7 @@ typedef struct tag_tvregsolver {
   int NumChannels;         /**< Number of image channels           */
   struct tag_tvregopt Opt; /**< Solver options                     */
   int UseZ;                /**< True if selected algorithm uses z  */
+  int Periodic;            /**< True if the DFT solver is periodic */
 
   num *A, *B;              /**< Spatial FFTW buffers               */
   num *ATrans, *BTrans;    /**< Spectral FFTW buffers              */
@@ -105,6 +163,7 @@ typedef struct tag_tvregsolver {
   FFT(plan) TransformB;    /**< Forward transform plan B -> BTrans */
   FFT(plan) InvTransformA; /**< Inverse transform plan ATrans -> A */
   FFT(plan) InvTransformB; /**< Inverse transform plan BTrans -> B */
+  FFT(plan) TransformKernel; /**< Kernel transform plan B -> KernelTrans */
 } tvregsolver;
 
 typedef num (*usolver)(tvregsolver *);
@@ -153,7 +212,11 @@ static const tvregopt TvRegDefaultOpt = {TVREGOPT_DEFAULT_LAMBDA,
                                          NOISEMODEL_L2,
                                          TvRestoreSimplePlot,
                                          NULL,
-                                         NULL};
+                                         NULL,
+                                         NULL,
+                                         1,
+                                         NULL,
+                                         0};
 
 /**
  * @brief Create a new tvregopt options object
@@ -243,6 +306,47 @@ inline void TvRegSetMaxIter(tvregopt *Opt, int MaxIter) {
   if (Opt) Opt->MaxIter = MaxIter;
 }
 
+/**
+ * @brief Specify the state reused between calls
+ * @param Opt tvregopt options object
+ * @param Context object created by TvRegNewContext(), or NULL
+ *
+ * Context is only used if its dimensions match the image passed to TvRestore.
+ * TvRestore modifies it, so it must not be used by concurrent calls.
+ */
+inline void TvRegSetContext(tvregopt *Opt, tvregcontext *Context) {
+  if (Opt) Opt->Context = Context;
+}
+
+/**
+ * @brief Specify periodic boundaries for nonsymmetric kernels
+ * @param Opt tvregopt options object
+ * @param Periodic 1 if the image is periodic, 0 otherwise (default)
+ *
+ * By default, the DFT solver (nonsymmetric kernels) extends the image
+ * symmetrically to twice its size in each direction.  For an image made
+ * periodic beforehand (for instance by tapering its borders), the periodic
+ * mode transforms the image at its native size, with periodic gradient and
+ * divergence, which divides the size of the transforms by four.  The DCT
+ * solver (symmetric kernels) is unaffected.
+ */
+inline void TvRegSetPeriodic(tvregopt *Opt, int Periodic) {
+  if (Opt) Opt->Periodic = Periodic;
+}
+
+/**
+ * @brief Specify the number of threads of the pointwise loops
+ * @param Opt tvregopt options object
+ * @param NumThreads size of the team (1 to run them sequentially)
+ *
+ * The threads only split elementwise loops, so the result does not depend
+ * on NumThreads.  The team is nested if TvRestore is called from a parallel
+ * region.
+ */
+inline void TvRegSetNumThreads(tvregopt *Opt, int NumThreads) {
+  if (Opt) Opt->NumThreads = NumThreads;
+}
+
 /**
  * @brief Specify plotting function
  * @param Opt tvregopt options object
@@ -289,3 +393,5 @@ inline void TvRegSetPlotFun(tvregopt *Opt,
     Opt->PlotParam = PlotParam;
   }
 }
+
+#endif
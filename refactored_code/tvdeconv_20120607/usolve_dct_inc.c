@@ -28,7 +28,7 @@
  */
 static void AdjBlurDct(num *ATrans, FFT(plan) TransformA,
                        const num *KernelTrans, int Width, int Height,
-                       int NumChannels, num Alpha) {
+                       int NumChannels, num Alpha, int NumThreads) {
   const long NumPixels = ((long)Width) * ((long)Height);
   long i;
   int k;
@@ -38,6 +38,9 @@ static void AdjBlurDct(num *ATrans, FFT(plan) TransformA,
 
   /* Compute ATrans = Alpha . KernelTrans . ATrans */
   for (k = 0; k < NumChannels; k++, ATrans += NumPixels)
+#ifdef _OPENMP
+#pragma omp parallel for num_threads(NumThreads) if (NumThreads > 1)
+#endif
     for (i = 0; i < NumPixels; i++)
       ATrans[i] = Alpha * KernelTrans[i] * ATrans[i];
 }
@@ -54,7 +57,6 @@ int InitDeconvDct(tvregsolver *S) {
   const num Alpha = S->Alpha;
   const long NumPixels = ((long)Width) * ((long)Height);
   const long PadNumPixels = ((long)Width + 1) * ((long)Height + 1);
-  FFT(plan) Plan = NULL;
   FFT(r2r_kind) Kind[2];
   long i;
   int x0, y0, x, y, xi, yi, Size[2];
@@ -77,67 +79,74 @@ int InitDeconvDct(tvregsolver *S) {
   }
 
   /* Compute the DCT-I transform of the padded Kernel */
+  if (!S->TransformKernel) {
 #ifdef _OPENMP
 #pragma omp critical(fftw)
 #endif
-  exit = !(Plan = FFT(plan_r2r_2d)(Height + 1, Width + 1, B, KernelTrans,
-                                   FFTW_REDFT00, FFTW_REDFT00,
-                                   FFTW_ESTIMATE | FFTW_DESTROY_INPUT));
-  if (exit) return 0;
+    S->TransformKernel = FFT(plan_r2r_2d)(
+        Height + 1, Width + 1, B, KernelTrans, FFTW_REDFT00, FFTW_REDFT00,
+        FFTW_ESTIMATE | FFTW_DESTROY_INPUT);
+    if (!S->TransformKernel) return 0;
+  }
 
-  FFT(execute)(Plan);
-#ifdef _OPENMP
-#pragma omp critical(fftw)
-#endif
-  FFT(destroy_plan)(Plan);
+  FFT(execute)(S->TransformKernel);
 
   /* Cut last row and column from KernelTrans */
   for (y = 1, i = Width; y < Height; y++, i += Width)
     memmove(KernelTrans + i, KernelTrans + i + y, sizeof(num) * Width);
 
   /* Precompute the denominator that will be used in the u-subproblem. */
-  for (y = 0, i = 0; y < Height; y++)
-    for (x = 0; x < Width; x++, i++)
+  if (S->Opt.Shape && S->Opt.Shape->Width == Width &&
+      S->Opt.Shape->Height == Height) {
+    const num *Laplacian = S->Opt.Shape->DctLaplacian;
+
+    for (i = 0; i < NumPixels; i++)
       DenomTrans[i] =
           (num)(4 * NumPixels *
-                (Alpha * KernelTrans[i] * KernelTrans[i] +
-                 2 * (2 - cos(x * M_PI / Width) - cos(y * M_PI / Height))));
-
-  /* Plan DCT-II transforms */
-  Size[1] = Width;
-  Size[0] = Height;
-  Kind[0] = Kind[1] = FFTW_REDFT10;
+                (Alpha * KernelTrans[i] * KernelTrans[i] + Laplacian[i]));
+  } else
+    for (y = 0, i = 0; y < Height; y++)
+      for (x = 0; x < Width; x++, i++)
+        DenomTrans[i] = (num)(4 * NumPixels *
+                              (Alpha * KernelTrans[i] * KernelTrans[i] +
+                               2 * (2 - cos(x * M_PI / Width) -
+                                    cos(y * M_PI / Height))));
+
+  /* Plan DCT-II transforms and their inverses (DCT-III), kept by a context */
+  if (!S->TransformA) {
+    Size[1] = Width;
+    Size[0] = Height;
+    Kind[0] = Kind[1] = FFTW_REDFT10;
 
 #ifdef _OPENMP
 #pragma omp critical(fftw)
 #endif
-  exit = !(S->TransformA = FFT(plan_many_r2r)(
-               2, Size, S->NumChannels, S->A, NULL, 1, NumPixels, S->ATrans,
-               NULL, 1, NumPixels, Kind, FFTW_ESTIMATE | FFTW_DESTROY_INPUT)) ||
-         !(S->TransformB = FFT(plan_many_r2r)(
-               2, Size, S->NumChannels, S->B, NULL, 1, NumPixels, S->BTrans,
-               NULL, 1, NumPixels, Kind, FFTW_ESTIMATE | FFTW_DESTROY_INPUT));
-  if (exit) return 0;
+    exit = !(S->TransformA = FFT(plan_many_r2r)(
+                 2, Size, S->NumChannels, S->A, NULL, 1, NumPixels, S->ATrans,
+                 NULL, 1, NumPixels, Kind, FFTW_ESTIMATE | FFTW_DESTROY_INPUT)) ||
+           !(S->TransformB = FFT(plan_many_r2r)(
+                 2, Size, S->NumChannels, S->B, NULL, 1, NumPixels, S->BTrans,
+                 NULL, 1, NumPixels, Kind, FFTW_ESTIMATE | FFTW_DESTROY_INPUT));
+    if (exit) return 0;
 
-  /* Plan inverse DCT-II transforms (DCT-III) */
-  Kind[0] = Kind[1] = FFTW_REDFT01;
+    Kind[0] = Kind[1] = FFTW_REDFT01;
 
 #ifdef _OPENMP
 #pragma omp critical(fftw)
 #endif
-  exit = !(S->InvTransformA = FFT(plan_many_r2r)(
-               2, Size, S->NumChannels, S->ATrans, NULL, 1, NumPixels, S->A,
-               NULL, 1, NumPixels, Kind, FFTW_ESTIMATE | FFTW_DESTROY_INPUT)) ||
-         !(S->InvTransformB = FFT(plan_many_r2r)(
-               2, Size, S->NumChannels, S->BTrans, NULL, 1, NumPixels, S->B,
-               NULL, 1, NumPixels, Kind, FFTW_ESTIMATE | FFTW_DESTROY_INPUT));
-  if (exit) return 0;
-
+    exit = !(S->InvTransformA = FFT(plan_many_r2r)(
+                 2, Size, S->NumChannels, S->ATrans, NULL, 1, NumPixels, S->A,
+                 NULL, 1, NumPixels, Kind, FFTW_ESTIMATE | FFTW_DESTROY_INPUT)) ||
+           !(S->InvTransformB = FFT(plan_many_r2r)(
+                 2, Size, S->NumChannels, S->BTrans, NULL, 1, NumPixels, S->B,
+                 NULL, 1, NumPixels, Kind, FFTW_ESTIMATE | FFTW_DESTROY_INPUT));
+    if (exit) return 0;
+  }
   /* Compute ATrans = Alpha . KernelTrans . DCT[f] */
   if (!S->UseZ) {
     memcpy(S->A, S->f, sizeof(num) * NumPixels * S->NumChannels);
     AdjBlurDct(S->ATrans, S->TransformA, KernelTrans, Width, Height,
-               S->NumChannels, Alpha);
+               S->NumChannels, Alpha, S->Opt.NumThreads);
   }
 
   S->Ku = S->A;
@@ -150,30 +159,29 @@ int InitDeconvDct(tvregsolver *S) {
  * This subroutine is a part of the DCT u-subproblem solution that is common
  * to both the d,u splitting (UseZ = 0) and d,u,z splitting (UseZ = 1).
  */
-static void UTransSolveDct(num *BTrans, num *B, FFT(plan) TransformB,
-                           num *ATrans, const numvec2 *dtilde,
+static void UTransSolveDct(num *BTrans, FFT(plan) TransformB, num *ATrans,
                            const num *DenomTrans, int Width, int Height,
-                           int NumChannels) {
+                           int NumChannels, int NumThreads) {
   const long NumPixels = ((long)Width) * ((long)Height);
   long i;
   int k;
 
-  /* Compute B = div(dtilde) */
-  Divergence(B, Width, Height, dtilde, Width, Height, NumChannels);
-
-  /* Compute BTrans = DCT[B] */
+  /* Compute BTrans = DCT[B], B = div(dtilde) is computed by DSolve() */
   FFT(execute)(TransformB);
 
   /* Compute BTrans = ( ATrans - BTrans ) / DenomTrans */
   for (k = 0; k < NumChannels; k++, ATrans += NumPixels, BTrans += NumPixels)
+#ifdef _OPENMP
+#pragma omp parallel for num_threads(NumThreads) if (NumThreads > 1)
+#endif
     for (i = 0; i < NumPixels; i++)
       BTrans[i] = (ATrans[i] - BTrans[i]) / DenomTrans[i];
 }
 
 num UDeconvDct(tvregsolver *S) {
   /* BTrans = ( ATrans - DCT[div(dtilde)] ) / DenomTrans */
-  UTransSolveDct(S->BTrans, S->B, S->TransformB, S->ATrans, S->dtilde,
-                 S->DenomTrans, S->Width, S->Height, S->NumChannels);
+  UTransSolveDct(S->BTrans, S->TransformB, S->ATrans, S->DenomTrans, S->Width,
+                 S->Height, S->NumChannels, S->Opt.NumThreads);
   /* B = IDCT[BTrans] */
   FFT(execute)(S->InvTransformB);
   /* Compute ||B - u||, and assign u = B */
@@ -205,10 +213,10 @@ static num UDeconvDctZ(tvregsolver *S) {
   /* Compute ATrans = Alpha . KernelTrans . DCT[ztilde] */
   memcpy(S->A, S->ztilde, sizeof(num) * NumPixels * NumChannels);
   AdjBlurDct(ATrans, S->TransformA, KernelTrans, S->Width, S->Height,
-             NumChannels, S->Alpha);
+             NumChannels, S->Alpha, S->Opt.NumThreads);
   /* BTrans = ( ATrans - DCT[div(dtilde)] ) / DenomTrans */
-  UTransSolveDct(BTrans, S->B, S->TransformB, ATrans, S->dtilde, S->DenomTrans,
-                 S->Width, S->Height, NumChannels);
+  UTransSolveDct(BTrans, S->TransformB, ATrans, S->DenomTrans, S->Width,
+                 S->Height, NumChannels, S->Opt.NumThreads);
 
   /* Compute ATrans = KernelTrans . BTrans */
   for (k = 0; k < NumChannels; k++, ATrans += NumPixels, BTrans += NumPixels)
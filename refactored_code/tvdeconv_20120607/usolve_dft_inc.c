@@ -20,53 +20,67 @@
  * @param Dest the destination
  * @param Src the source image
  * @param Width, Height, NumChannels the dimensions of Src
+ * @param NumThreads size of the team sharing the rows
  *
  * The Src image of size Width by Height is reflected over each axis to
  * create an image that is 2*Width by 2*Height.
  */
 static void SymmetricPadding(num *Dest, const num *Src, int Width, int Height,
-                             int NumChannels) {
+                             int NumChannels, int NumThreads) {
   const int InPlace = (Dest == Src);
-  const int PadWidth = 2 * Width;
-  const long ChannelJump = ((long)PadWidth) * ((long)Height);
-  const int SrcStride = (InPlace) ? PadWidth : Width;
-  int x, y, k;
-
-  for (k = 0; k < NumChannels; k++) {
-    for (y = 0; y < Height; y++, Dest += PadWidth, Src += SrcStride) {
-      if (!InPlace) memcpy(Dest, Src, sizeof(num) * Width);
+  const long PadWidth = 2 * Width;
+  const long PadChannelStride = PadWidth * 2 * Height;
+  const long SrcChannelStride =
+      (InPlace) ? PadChannelStride : ((long)Width) * Height;
+  const long SrcStride = (InPlace) ? PadWidth : Width;
+  const int NumRows = Height * NumChannels;
+  int Row;
 
-      for (x = 0; x < Width; x++) Dest[Width + x] = Dest[Width - 1 - x];
+#ifdef _OPENMP
+#pragma omp parallel for num_threads(NumThreads) if (NumThreads > 1)
+#endif
+  for (Row = 0; Row < NumRows; Row++) {
+    const int k = Row / Height, y = Row % Height;
+    num *DestRow = Dest + PadChannelStride * k + PadWidth * y;
+    const num *SrcRow = Src + SrcChannelStride * k + SrcStride * y;
+    int x;
 
-      memcpy(Dest + ((long)(2 * (Height - y) - 1)) * PadWidth, Dest,
-             sizeof(num) * PadWidth);
-    }
+    if (!InPlace) memcpy(DestRow, SrcRow, sizeof(num) * Width);
 
-    Dest += ChannelJump;
+    for (x = 0; x < Width; x++) DestRow[Width + x] = DestRow[Width - 1 - x];
 
-    if (InPlace) Src = Dest;
+    memcpy(DestRow + (2 * (Height - y) - 1) * PadWidth, DestRow,
+           sizeof(num) * PadWidth);
   }
 }
 
 /** @brief Compute ATrans = Alpha . conj(KernelTrans) . DFT[ztilde] */
 static void AdjBlurFourier(numcomplex *ATrans, num *A, FFT(plan) TransformA,
                            const numcomplex *KernelTrans, const num *ztilde,
-                           int Width, int Height, int NumChannels, num Alpha) {
-  const int PadWidth = 2 * Width;
-  const int PadHeight = 2 * Height;
+                           int Width, int Height, int NumChannels, num Alpha,
+                           int Periodic, int NumThreads) {
+  const int PadWidth = (Periodic) ? Width : 2 * Width;
+  const int PadHeight = (Periodic) ? Height : 2 * Height;
   const int TransWidth = PadWidth / 2 + 1;
   const long TransNumPixels = ((long)TransWidth) * ((long)PadHeight);
   long i;
   int k;
 
-  /* Compute A as a symmetric padded version of ztilde */
-  SymmetricPadding(A, ztilde, Width, Height, NumChannels);
+  /* Compute A as a symmetric padded version of ztilde (or a copy of it
+     with periodic boundaries) */
+  if (Periodic)
+    memcpy(A, ztilde, sizeof(num) * Width * Height * NumChannels);
+  else
+    SymmetricPadding(A, ztilde, Width, Height, NumChannels, NumThreads);
 
   /* Compute ATrans = DFT[A] */
   FFT(execute)(TransformA);
 
   /* Compute ATrans = Alpha . conj(KernelTrans) . ATrans */
   for (k = 0; k < NumChannels; k++, ATrans += TransNumPixels)
+#ifdef _OPENMP
+#pragma omp parallel for num_threads(NumThreads) if (NumThreads > 1)
+#endif
     for (i = 0; i < TransNumPixels; i++) {
       num Temp = Alpha * (KernelTrans[i][0] * ATrans[i][1] -
                           KernelTrans[i][1] * ATrans[i][0]);
@@ -90,7 +104,6 @@ int InitDeconvFourier(tvregsolver *S) {
   const num Alpha = S->Alpha;
   const long PadNumPixels = ((long)PadWidth) * ((long)PadHeight);
   const int TransWidth = PadWidth / 2 + 1;
-  FFT(plan) Plan = NULL;
   long i;
   int PadSize[2], x0, y0, x, y, xi, yi;
   int exit;
@@ -112,56 +125,71 @@ int InitDeconvFourier(tvregsolver *S) {
   }
 
   /* Compute the Fourier transform of the padded Kernel */
+  if (!S->TransformKernel) {
 #ifdef _OPENMP
 #pragma omp critical(fftw)
 #endif
-  exit = !(Plan = FFT(plan_dft_r2c_2d)(PadHeight, PadWidth, B, KernelTrans,
-                                       FFTW_ESTIMATE | FFTW_DESTROY_INPUT));
-  if (exit) return 0;
+    S->TransformKernel = FFT(plan_dft_r2c_2d)(
+        PadHeight, PadWidth, B, KernelTrans,
+        FFTW_ESTIMATE | FFTW_DESTROY_INPUT);
+    if (!S->TransformKernel) return 0;
+  }
 
-  FFT(execute)(Plan);
-#ifdef _OPENMP
-#pragma omp critical(fftw)
-#endif
-  FFT(destroy_plan)(Plan);
+  FFT(execute)(S->TransformKernel);
 
   /* Precompute the denominator that will be used in the u-subproblem. */
-  for (y = 0, i = 0; y < PadHeight; y++)
-    for (x = 0; x < TransWidth; x++, i++)
+  if (S->Opt.Shape && S->Opt.Shape->Width == S->Width &&
+      S->Opt.Shape->Height == S->Height) {
+    const num *Laplacian = (S->Periodic) ? S->Opt.Shape->PeriodicLaplacian
+                                         : S->Opt.Shape->FourierLaplacian;
+
+    for (i = 0; i < TransWidth * PadHeight; i++)
       DenomTrans[i] = (num)(PadNumPixels *
                             (Alpha * (KernelTrans[i][0] * KernelTrans[i][0] +
                                       KernelTrans[i][1] * KernelTrans[i][1]) +
-                             2 * (2 - cos(x * M_2PI / PadWidth) -
-                                  cos(y * M_2PI / PadHeight))));
-
-  /* Plan Fourier transforms */
-  PadSize[1] = PadWidth;
-  PadSize[0] = PadHeight;
+                             Laplacian[i]));
+  } else
+    for (y = 0, i = 0; y < PadHeight; y++)
+      for (x = 0; x < TransWidth; x++, i++)
+        DenomTrans[i] =
+            (num)(PadNumPixels *
+                  (Alpha * (KernelTrans[i][0] * KernelTrans[i][0] +
+                            KernelTrans[i][1] * KernelTrans[i][1]) +
+                   2 * (2 - cos(x * M_2PI / PadWidth) -
+                        cos(y * M_2PI / PadHeight))));
+
+  /* Plan Fourier transforms (kept by a context) */
+  if (!S->TransformA) {
+    PadSize[1] = PadWidth;
+    PadSize[0] = PadHeight;
 
 #ifdef _OPENMP
 #pragma omp critical(fftw)
 #endif
-  exit =
-      !(S->TransformA = FFT(plan_many_dft_r2c)(
-            2, PadSize, S->NumChannels, S->A, NULL, 1, PadNumPixels, ATrans,
-            NULL, 1, TransWidth * PadHeight,
-            FFTW_ESTIMATE | FFTW_DESTROY_INPUT)) ||
-      !(S->InvTransformA = FFT(plan_many_dft_c2r)(
-            2, PadSize, S->NumChannels, ATrans, NULL, 1, TransWidth * PadHeight,
-            S->A, NULL, 1, PadNumPixels, FFTW_ESTIMATE | FFTW_DESTROY_INPUT)) ||
-      !(S->TransformB = FFT(plan_many_dft_r2c)(
-            2, PadSize, S->NumChannels, S->B, NULL, 1, PadNumPixels, BTrans,
-            NULL, 1, TransWidth * PadHeight,
-            FFTW_ESTIMATE | FFTW_DESTROY_INPUT)) ||
-      !(S->InvTransformB = FFT(plan_many_dft_c2r)(
-            2, PadSize, S->NumChannels, BTrans, NULL, 1, TransWidth * PadHeight,
-            S->B, NULL, 1, PadNumPixels, FFTW_ESTIMATE | FFTW_DESTROY_INPUT));
-  if (exit) return 0;
+    exit = !(S->TransformA = FFT(plan_many_dft_r2c)(
+                 2, PadSize, S->NumChannels, S->A, NULL, 1, PadNumPixels,
+                 ATrans, NULL, 1, TransWidth * PadHeight,
+                 FFTW_ESTIMATE | FFTW_DESTROY_INPUT)) ||
+           !(S->InvTransformA = FFT(plan_many_dft_c2r)(
+                 2, PadSize, S->NumChannels, ATrans, NULL, 1,
+                 TransWidth * PadHeight, S->A, NULL, 1, PadNumPixels,
+                 FFTW_ESTIMATE | FFTW_DESTROY_INPUT)) ||
+           !(S->TransformB = FFT(plan_many_dft_r2c)(
+                 2, PadSize, S->NumChannels, S->B, NULL, 1, PadNumPixels,
+                 BTrans, NULL, 1, TransWidth * PadHeight,
+                 FFTW_ESTIMATE | FFTW_DESTROY_INPUT)) ||
+           !(S->InvTransformB = FFT(plan_many_dft_c2r)(
+                 2, PadSize, S->NumChannels, BTrans, NULL, 1,
+                 TransWidth * PadHeight, S->B, NULL, 1, PadNumPixels,
+                 FFTW_ESTIMATE | FFTW_DESTROY_INPUT));
+    if (exit) return 0;
+  }
 
   /* Compute ATrans = Alpha . conj(KernelTrans) . DFT[f] */
   if (!S->UseZ)
     AdjBlurFourier(ATrans, S->A, S->TransformA, (const numcomplex *)KernelTrans,
-                   S->f, S->Width, S->Height, S->NumChannels, Alpha);
+                   S->f, S->Width, S->Height, S->NumChannels, Alpha,
+                   S->Periodic, S->Opt.NumThreads);
 
   S->Ku = S->A;
   return 1;
@@ -173,27 +201,27 @@ int InitDeconvFourier(tvregsolver *S) {
  * This subroutine is a part of the DFT u-subproblem solution that is common
  * to both the d,u splitting (UseZ=0) and d,u,z splitting (UseZ=1).
  */
-static void UTransSolveFourier(numcomplex *BTrans, num *B, FFT(plan) TransformB,
-                               numcomplex *ATrans, const numvec2 *dtilde,
-                               const num *DenomTrans, int Width, int Height,
-                               int NumChannels) {
-  const long PadWidth = 2 * Width;
-  const long PadHeight = 2 * Height;
+static void UTransSolveFourier(numcomplex *BTrans, FFT(plan) TransformB,
+                               numcomplex *ATrans, const num *DenomTrans,
+                               int Width, int Height, int NumChannels,
+                               int Periodic, int NumThreads) {
+  const long PadWidth = (Periodic) ? Width : 2 * Width;
+  const long PadHeight = (Periodic) ? Height : 2 * Height;
   const long TransWidth = PadWidth / 2 + 1;
   const long TransNumPixels = TransWidth * PadHeight;
   long i;
   int k;
 
-  /* Compute B = div(dtilde) and pad with even half-sample symmetry */
-  Divergence(B, PadWidth, PadHeight, dtilde, Width, Height, NumChannels);
-  SymmetricPadding(B, B, Width, Height, NumChannels);
-
-  /* Compute BTrans = DFT[B] */
+  /* Compute BTrans = DFT[B], B = div(dtilde) padded with even half-sample
+     symmetry (or not, with periodic boundaries) is computed by DSolve() */
   FFT(execute)(TransformB);
 
   /* Compute BTrans = ( ATrans - BTrans ) / DenomTrans */
   for (k = 0; k < NumChannels;
        k++, ATrans += TransNumPixels, BTrans += TransNumPixels)
+#ifdef _OPENMP
+#pragma omp parallel for num_threads(NumThreads) if (NumThreads > 1)
+#endif
     for (i = 0; i < TransNumPixels; i++) {
       BTrans[i][0] = (ATrans[i][0] - BTrans[i][0]) / DenomTrans[i];
       BTrans[i][1] = (ATrans[i][1] - BTrans[i][1]) / DenomTrans[i];
@@ -202,9 +230,9 @@ static void UTransSolveFourier(numcomplex *BTrans, num *B, FFT(plan) TransformB,
 
 num UDeconvFourier(tvregsolver *S) {
   /* BTrans = ( ATrans - DFT[div(dtilde)] ) / DenomTrans */
-  UTransSolveFourier((numcomplex *)S->BTrans, S->B, S->TransformB,
-                     (numcomplex *)S->ATrans, S->dtilde, S->DenomTrans,
-                     S->Width, S->Height, S->NumChannels);
+  UTransSolveFourier((numcomplex *)S->BTrans, S->TransformB,
+                     (numcomplex *)S->ATrans, S->DenomTrans, S->Width,
+                     S->Height, S->NumChannels, S->Periodic, S->Opt.NumThreads);
   /* B = IDFT[BTrans] */
   FFT(execute)(S->InvTransformB);
   /* Trim padding, compute ||B - u||, and assign u = B */
@@ -231,11 +259,12 @@ static num UDeconvFourierZ(tvregsolver *S) {
 
   /* Compute ATrans = Alpha . conj(KernelTrans) . DFT[ztilde] */
   AdjBlurFourier(ATrans, S->A, S->TransformA, KernelTrans, S->ztilde, S->Width,
-                 S->Height, S->NumChannels, S->Alpha);
+                 S->Height, S->NumChannels, S->Alpha, S->Periodic,
+                 S->Opt.NumThreads);
   /* BTrans = ( ATrans - DFT[div(dtilde)] ) / DenomTrans */
-  UTransSolveFourier((numcomplex *)S->BTrans, S->B, S->TransformB, ATrans,
-                     S->dtilde, S->DenomTrans, S->Width, S->Height,
-                     S->NumChannels);
+  UTransSolveFourier((numcomplex *)S->BTrans, S->TransformB, ATrans,
+                     S->DenomTrans, S->Width, S->Height, S->NumChannels,
+                     S->Periodic, S->Opt.NumThreads);
 
   /* Compute ATrans = KernelTrans . BTrans */
   for (k = 0; k < S->NumChannels;